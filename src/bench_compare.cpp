@@ -0,0 +1,170 @@
+// Compare benchmarking results files, see usage() below
+
+#include "util.h"
+#include "external/json.hpp"
+
+#include <fstream>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+static double threshold = 5.0; // percent slowdown
+static double alpha = 0.05;
+static int resamples = 2000;
+static std::string metric = "time";
+
+static void show_usage()
+{
+	printf("Usage: bench_compare [options] baseline.json candidate.json [more candidates...]\n");
+	printf("Compares the iteration times of each scene of each candidate benchmarking results file against the baseline.\n");
+	printf("Ratios are candidate over baseline, so above 1 is slower.\n");
+	printf("Exits with 1 if any scene has a statistically significant regression above the threshold or is missing from\n");
+	printf("a candidate, 2 on bad input or if there is nothing to compare.\n");
+	printf("-h/--help              This help\n");
+	printf("-t/--threshold P       Slowdown in percent of the median to treat as a regression (default %g)\n", threshold);
+	printf("-a/--alpha A           Significance level of the Mann-Whitney U test (default %g)\n", alpha);
+	printf("-b/--bootstrap N       Number of bootstrap resamples for confidence intervals (default %d)\n", resamples);
+	printf("-m/--metric M          Which duration to compare, time or gpu_duration (default %s)\n", metric.c_str());
+	exit(2);
+}
+
+/// Durations per scene, in order of first appearance
+struct results_file
+{
+	std::vector<std::string> order;
+	std::map<std::string, std::vector<double>> scenes;
+};
+
+static bool load(const char* path, results_file& out)
+{
+	std::ifstream in(path);
+	if (!in) { ELOG("Cannot open %s", path); return false; }
+	nlohmann::json data = nlohmann::json::parse(in, nullptr, false);
+	if (data.is_discarded()) { ELOG("Cannot parse %s", path); return false; }
+	if (!data.count("results")) { ELOG("No results in %s", path); return false; }
+	for (const auto& r : data.at("results"))
+	{
+		if (!r.count(metric)) continue;
+		const std::string scene = r.value("scene", "(no scene)");
+		if (out.scenes.count(scene) == 0) out.order.push_back(scene);
+		out.scenes[scene].push_back(r.at(metric).get<double>());
+	}
+	if (out.order.empty()) { ELOG("No %s values in %s", metric.c_str(), path); return false; }
+	return true;
+}
+
+static double median(std::vector<double>& v) // reorders its input
+{
+	const size_t mid = v.size() / 2;
+	std::nth_element(v.begin(), v.begin() + mid, v.end());
+	if (v.size() % 2) return v[mid];
+	const double upper = v[mid];
+	return (*std::max_element(v.begin(), v.begin() + mid) + upper) / 2.0;
+}
+
+/// Two-sided p-value of the Mann-Whitney U test, using the normal approximation with tie correction
+static double mann_whitney(const std::vector<double>& a, const std::vector<double>& b)
+{
+	const double n1 = a.size();
+	const double n2 = b.size();
+	const double n = n1 + n2;
+	std::vector<std::pair<double, int>> all;
+	for (double v : a) all.push_back({ v, 0 });
+	for (double v : b) all.push_back({ v, 1 });
+	std::sort(all.begin(), all.end());
+	double rank_sum = 0.0; // of a
+	double ties = 0.0;
+	for (size_t i = 0; i < all.size();)
+	{
+		size_t j = i;
+		while (j < all.size() && all[j].first == all[i].first) j++;
+		const double rank = (i + 1 + j) / 2.0; // average rank of the tied group
+		for (size_t k = i; k < j; k++) if (all[k].second == 0) rank_sum += rank;
+		const double t = j - i;
+		ties += t * t * t - t;
+		i = j;
+	}
+	const double u = rank_sum - n1 * (n1 + 1) / 2.0;
+	const double mu = n1 * n2 / 2.0;
+	const double sigma = std::sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1))));
+	if (sigma == 0.0) return 1.0; // all values the same
+	const double z = (std::fabs(u - mu) - 0.5) / sigma; // with continuity correction
+	return std::erfc(std::max(z, 0.0) / std::sqrt(2.0));
+}
+
+/// Percentile bootstrap confidence interval (1 - alpha) of the ratio of candidate to baseline medians
+static std::pair<double, double> bootstrap(const std::vector<double>& base, const std::vector<double>& cand, std::mt19937_64& rng)
+{
+	std::vector<double> ratios(resamples);
+	std::vector<double> sa(base.size());
+	std::vector<double> sb(cand.size());
+	std::uniform_int_distribution<size_t> pick_a(0, base.size() - 1);
+	std::uniform_int_distribution<size_t> pick_b(0, cand.size() - 1);
+	for (int i = 0; i < resamples; i++)
+	{
+		for (double& v : sa) v = base[pick_a(rng)];
+		for (double& v : sb) v = cand[pick_b(rng)];
+		const double ma = median(sa);
+		ratios[i] = (ma > 0.0) ? median(sb) / ma : 1.0;
+	}
+	std::sort(ratios.begin(), ratios.end());
+	const size_t low = std::min<size_t>(resamples - 1, (size_t)(alpha / 2.0 * resamples));
+	const size_t high = std::min<size_t>(resamples - 1, (size_t)((1.0 - alpha / 2.0) * resamples));
+	return { ratios[low], ratios[high] };
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<const char*> files;
+	for (int i = 1; i < argc; i++)
+	{
+		if (match(argv[i], "-h", "--help")) show_usage();
+		else if (match(argv[i], "-t", "--threshold")) threshold = atof(get_string_arg(argv, ++i, argc));
+		else if (match(argv[i], "-a", "--alpha")) alpha = atof(get_string_arg(argv, ++i, argc));
+		else if (match(argv[i], "-b", "--bootstrap")) resamples = get_arg(argv, ++i, argc);
+		else if (match(argv[i], "-m", "--metric")) metric = get_string_arg(argv, ++i, argc);
+		else if (argv[i][0] == '-') { ELOG("Unrecognized cmd line parameter: %s", argv[i]); show_usage(); }
+		else files.push_back(argv[i]);
+	}
+	if (files.size() < 2 || resamples < 1 || alpha <= 0.0 || alpha >= 1.0) show_usage();
+
+	results_file baseline;
+	if (!load(files[0], baseline)) return 2;
+
+	std::mt19937_64 rng(1234); // fixed seed, so that runs are repeatable
+	int regressions = 0;
+	int missing = 0;
+	for (unsigned f = 1; f < files.size(); f++)
+	{
+		results_file candidate;
+		if (!load(files[f], candidate)) return 2;
+		printf("%s vs %s (%s, %g%% CI):\n", files[f], files[0], metric.c_str(), (1.0 - alpha) * 100.0);
+		printf("%-40s %8s %14s %14s %9s %19s %10s\n", "scene", "n", "base median", "median", "ratio", "ratio CI", "p");
+		int compared = 0;
+		for (const std::string& scene : baseline.order)
+		{
+			if (candidate.scenes.count(scene) == 0) { printf("%-40s missing from candidate\n", scene.c_str()); missing++; continue; }
+			std::vector<double> base = baseline.scenes.at(scene);
+			std::vector<double> cand = candidate.scenes.at(scene);
+			const double p = mann_whitney(base, cand);
+			const std::pair<double, double> ci = bootstrap(base, cand, rng);
+			const double base_median = median(base);
+			const double cand_median = median(cand);
+			const double ratio = (base_median > 0.0) ? cand_median / base_median : 1.0;
+			const bool regressed = p < alpha && (ratio - 1.0) * 100.0 > threshold;
+			if (regressed) regressions++;
+			compared++;
+			printf("%-40s %8zu %14.0f %14.0f %8.3fx [%7.3f, %7.3f] %10.2g%s\n", scene.c_str(), cand.size(), base_median, cand_median, ratio,
+			       ci.first, ci.second, p, regressed ? "  REGRESSION" : "");
+		}
+		if (compared == 0) { ELOG("No scenes in common between %s and %s", files[f], files[0]); return 2; }
+		for (const std::string& scene : candidate.order)
+		{
+			if (baseline.scenes.count(scene) == 0) printf("%-40s missing from baseline\n", scene.c_str());
+		}
+	}
+	if (regressions > 0) printf("%d significant regression(s) above %g%%\n", regressions, threshold);
+	if (missing > 0) printf("%d scene(s) missing from candidates\n", missing);
+	return (regressions > 0 || missing > 0) ? 1 : 0;
+}
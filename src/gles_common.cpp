@@ -60,7 +60,7 @@ static bool check_bench(TOOLSTEST& b, const TOOLSTEST_INIT& reqs)
 	if (enable_path)
 	{
 		printf("Reading benchmarking enable file: %s\n", enable_path);
-		uint32_t size = 0;
+		uint64_t size = 0;
 		content = load_blob(enable_path, &size);
 	}
 	else if (enable_json)
@@ -78,7 +78,23 @@ static bool check_bench(TOOLSTEST& b, const TOOLSTEST_INIT& reqs)
 	{
 		nlohmann::json caps = data.at("capabilities");
 
-		p__loops = caps.value("loops", p__loops);
+		b.times = caps.value("loops", b.times); // handle.times is already set from p__loops at this point
+		if (caps.count("loops") && b.times == 0) b.bench.state->loop_forever = true;
+		b.bench.state->loop_time = caps.value("loop_time", 0.0) * 1000000000.0;
+		if (caps.count("fixed_framerate") && caps.at("fixed_framerate").is_number() && caps.value("fixed_framerate", 0.0) > 0.0)
+		{
+			b.bench.state->frame_time = caps.value("fixed_framerate", 0.0) * 1000000.0; // given in milliseconds
+		}
+	}
+
+	if (data.count("settings"))
+	{
+		nlohmann::json settings = data.at("settings");
+
+		if (settings.count("cpu_affinity")) p__cpu_affinity = settings.value("cpu_affinity", "");
+		if (settings.count("worker_affinity")) p__worker_affinity = settings.value("worker_affinity", "");
+		if (settings.count("sched_fifo")) p__sched_fifo = settings.value("sched_fifo", false);
+		if (settings.count("bench_timer")) p__bench_timer = settings.value("bench_timer", "monotonic");
 	}
 
 	bench_init(b.bench, our_name.c_str(), content, data.value("results", "results.json").c_str());
@@ -142,6 +158,9 @@ static void usage(TOOLSTEST_CALLBACK_USAGE usage)
 	printf("-s/--step              Step mode\n");
 	printf("-i/--inject            Inject sanity checking\n");
 	printf("-n/--null-run          Skip testing of results\n");
+	printf("-af/--affinity CPUS    Pin the main thread to the given CPUs, eg 0-3,6 or big or little\n");
+	printf("-waf/--worker-affinity CPUS Pin worker threads to the given CPUs\n");
+	printf("-fifo/--sched-fifo     Run the main and worker threads with SCHED_FIFO scheduling\n");
 	if (usage) usage();
 	exit(1);
 }
@@ -203,6 +222,18 @@ int init(int argc, char** argv, const TOOLSTEST_INIT& init)
 		{
 			handle.times = get_arg(argv, ++i, argc);
 		}
+		else if (match(argv[i], "-af", "--affinity"))
+		{
+			p__cpu_affinity = get_string_arg(argv, ++i, argc);
+		}
+		else if (match(argv[i], "-waf", "--worker-affinity"))
+		{
+			p__worker_affinity = get_string_arg(argv, ++i, argc);
+		}
+		else if (match(argv[i], "-fifo", "--sched-fifo"))
+		{
+			p__sched_fifo = true;
+		}
 		else
 		{
 			if (!init.cmdopt || !init.cmdopt(i, argc, argv))
@@ -215,6 +246,8 @@ int init(int argc, char** argv, const TOOLSTEST_INIT& init)
 
 	handle.bench.backend_name = "GLES " + std::to_string(major_version) + "." + std::to_string(minor_version);
 	check_bench(handle, init);
+	thread_setup(THREAD_MAIN);
+	if (handle.bench.enable_file) thread_setup_run_info(handle.bench);
 
 #ifdef SDL
 	SDL_SetMainReady();
@@ -453,15 +486,17 @@ int init(int argc, char** argv, const TOOLSTEST_INIT& init)
 		ELOG("Setup failed");
 		return ret;
 	}
-	for (int i = 0; i < handle.times; i++)
+	for (int i = 0; bench_loop(handle.bench, handle.times); i++)
 	{
 		handle.current_frame = i;
+		handle.sim_time = bench_sim_time(handle.bench);
 		std::string annotation = std::string(init.name) + " frame " + std::to_string(handle.current_frame);
 		annotate(annotation.c_str());
 		bench_start_iteration(handle.bench);
 		init.swap(&handle);
 		test_swap(&handle);
 		bench_stop_iteration(handle.bench);
+		bench_next_frame(handle.bench);
 		if (step_mode)
 		{
 			char c = keypress();
@@ -73,6 +73,7 @@ struct TOOLSTEST
 	std::vector<EGLSurface> surface;
 #endif
 	int current_frame = 0;
+	double sim_time = 0.0; // simulated time of the current frame in seconds, animate from this
 	int debug = 0;
 
 	benchmarking bench;
@@ -73,6 +73,7 @@ static void draw(TOOLSTEST *handle, int surface)
 
 static void thread_runner(TOOLSTEST *handle, int me)
 {
+	set_thread_name("draw thread");
 	std::unique_lock<std::mutex> lk(mutex);
 	while (!done)
 	{
@@ -75,6 +75,7 @@ static void draw(TOOLSTEST *handle, int surface)
 
 static void thread_runner(TOOLSTEST *handle, int me)
 {
+	set_thread_name("draw thread");
 	std::unique_lock<std::mutex> lk(mutex);
 	const int idx = me + 1;
 	int frames = 0;
@@ -132,7 +132,7 @@ static int setupGraphics(TOOLSTEST *handle)
 // first frame render something, second frame verify it
 static void callback_draw(TOOLSTEST *handle)
 {
-	glProgramUniform1f(vertex_program, upos, handle->current_frame * 0.1f);
+	glProgramUniform1f(vertex_program, upos, handle->sim_time * 6.0f); // 0.1 per frame at the default 60 fps
 	glDrawArrays(GL_TRIANGLES, 0, 3);
 
 	// verify in retracer
@@ -24,7 +24,7 @@ static bool check_bench(opencl_setup_t& cl, opencl_req_t& reqs, const char* test
 	if (enable_path)
 	{
 		printf("Reading benchmarking enable file: %s\n", enable_path);
-		uint32_t size = 0;
+		uint64_t size = 0;
 		content = load_blob(enable_path, &size);
 	}
 	else if (enable_json)
@@ -38,6 +38,16 @@ static bool check_bench(opencl_setup_t& cl, opencl_req_t& reqs, const char* test
 	if (!data.count("target")) { printf("No app name in benchmarking enable file - skipping!\n"); return false; }
 	if (data.value("target", "no target") != testname) { printf("Name in benchmarking enable file is not ours - skipping\n"); return false; }
 
+	if (data.count("settings"))
+	{
+		nlohmann::json settings = data.at("settings");
+
+		if (settings.count("cpu_affinity")) p__cpu_affinity = settings.value("cpu_affinity", "");
+		if (settings.count("worker_affinity")) p__worker_affinity = settings.value("worker_affinity", "");
+		if (settings.count("sched_fifo")) p__sched_fifo = settings.value("sched_fifo", false);
+		if (settings.count("bench_timer")) p__bench_timer = settings.value("bench_timer", "monotonic");
+	}
+
 	bench_init(cl.bench, testname, content, data.value("results", "results.json").c_str());
 
 	return true;
@@ -121,6 +131,9 @@ opencl_setup_t cl_test_init(int argc, char** argv, const std::string& testname,
 		print_usage(reqs);
 	}
 
+	thread_setup(THREAD_MAIN);
+	if (cl.bench.enable_file) thread_setup_run_info(cl.bench);
+
 	cl_int r;
 	cl_uint num_platforms;
 	r = clGetPlatformIDs(0, nullptr, &num_platforms);
@@ -2,9 +2,21 @@
 
 #include "external/json.hpp"
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <inttypes.h>
+#include <thread>
+#include <condition_variable>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <errno.h>
 
 #if defined(_GNU_SOURCE) || defined(__BIONIC__)
 #include <pthread.h>
@@ -12,6 +24,17 @@
 #include <sys/prctl.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #ifdef SDL
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
@@ -28,48 +51,788 @@ int get_env_int(const char* name, int fallback)
 	return v;
 }
 
+static const uint64_t hash_prime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t hash_prime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t hash_prime3 = 0x165667B19E3779F9ull;
+static const uint64_t hash_prime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t hash_prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t hash_rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+static inline uint64_t hash_read64(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; } // little endian only
+static inline uint32_t hash_read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) { return hash_rotl(acc + input * hash_prime2, 31) * hash_prime1; }
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v) { return (acc ^ hash_round(0, v)) * hash_prime1 + hash_prime4; }
+
+uint64_t hash64(const void* data, size_t len, uint64_t seed)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* const end = p + len;
+	uint64_t h;
+	if (len >= 32)
+	{
+		// four independent lanes, so that the multiplies can overlap
+		uint64_t v1 = seed + hash_prime1 + hash_prime2;
+		uint64_t v2 = seed + hash_prime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - hash_prime1;
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = hash_round(v1, hash_read64(p));
+			v2 = hash_round(v2, hash_read64(p + 8));
+			v3 = hash_round(v3, hash_read64(p + 16));
+			v4 = hash_round(v4, hash_read64(p + 24));
+		}
+		h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+		h = hash_merge(h, v1);
+		h = hash_merge(h, v2);
+		h = hash_merge(h, v3);
+		h = hash_merge(h, v4);
+	}
+	else h = seed + hash_prime5;
+	h += len;
+	for (; p + 8 <= end; p += 8) h = hash_rotl(h ^ hash_round(0, hash_read64(p)), 27) * hash_prime1 + hash_prime4;
+	if (p + 4 <= end) { h = hash_rotl(h ^ (hash_read32(p) * hash_prime1), 23) * hash_prime2 + hash_prime3; p += 4; }
+	for (; p < end; p++) h = hash_rotl(h ^ (*p * hash_prime5), 11) * hash_prime1;
+	h ^= h >> 33;
+	h *= hash_prime2;
+	h ^= h >> 29;
+	h *= hash_prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint32_t adler32_update(uint32_t adler, const void* data, size_t len)
+{
+	const uint32_t mod = 65521;
+	const size_t nmax = 5552; // most bytes we can sum before b may overflow 32 bits
+	const uint8_t* p = (const uint8_t*)data;
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	while (len > 0)
+	{
+		size_t n = std::min(len, nmax);
+		len -= n;
+		for (; n >= 8; n -= 8, p += 8)
+		{
+			a += p[0]; b += a; a += p[1]; b += a; a += p[2]; b += a; a += p[3]; b += a;
+			a += p[4]; b += a; a += p[5]; b += a; a += p[6]; b += a; a += p[7]; b += a;
+		}
+		for (; n > 0; n--, p++) { a += *p; b += a; }
+		a %= mod;
+		b %= mod;
+	}
+	return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+	const uint64_t mod = 65521;
+	const uint64_t rem = len2 % mod;
+	const uint64_t a1 = adler1 & 0xffff;
+	const uint64_t b1 = adler1 >> 16;
+	const uint64_t a = (a1 + (adler2 & 0xffff) + mod - 1) % mod;
+	const uint64_t b = (rem * a1 + b1 + (adler2 >> 16) + mod - rem) % mod;
+	return (uint32_t)((b << 16) | a);
+}
+
+static const uint32_t crc32c_poly = 0x82f63b78; // reflected
+
+/// Multiply two polynomials modulo the CRC polynomial, in the reflected bit order
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t p = 0;
+	for (uint32_t m = 1u << 31; m != 0; m >>= 1)
+	{
+		if (a & m) p ^= b;
+		b = (b & 1) ? (b >> 1) ^ crc32c_poly : b >> 1;
+	}
+	return p;
+}
+
+struct crc32c_tables
+{
+	uint32_t bytes[8][256]; // slicing by eight, for when there is no CRC instruction
+	uint32_t powers[64]; // x^(2^n) modulo the polynomial
+	bool hardware = false;
+
+	crc32c_tables()
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ crc32c_poly : c >> 1;
+			bytes[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			for (int t = 1; t < 8; t++) bytes[t][i] = (bytes[t - 1][i] >> 8) ^ bytes[0][bytes[t - 1][i] & 0xff];
+		}
+		powers[0] = 1u << 30; // x^1
+		for (int n = 1; n < 64; n++) powers[n] = crc32c_multiply(powers[n - 1], powers[n - 1]);
+#if defined(__x86_64__)
+		unsigned eax, ebx, ecx, edx;
+		hardware = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#elif defined(__aarch64__)
+		hardware = getauxval(AT_HWCAP) & HWCAP_CRC32;
+#endif
+	}
+};
+static const crc32c_tables crc32c_table;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* p, size_t len)
+{
+	uint64_t c = crc;
+	for (; len >= 8; len -= 8, p += 8) { uint64_t v; memcpy(&v, p, 8); c = _mm_crc32_u64(c, v); }
+	for (; len > 0; len--, p++) c = _mm_crc32_u8((uint32_t)c, *p);
+	return (uint32_t)c;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* p, size_t len)
+{
+	for (; len >= 8; len -= 8, p += 8) { uint64_t v; memcpy(&v, p, 8); crc = __crc32cd(crc, v); }
+	for (; len > 0; len--, p++) crc = __crc32cb(crc, *p);
+	return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	crc = ~crc;
+#if defined(__x86_64__) || defined(__aarch64__)
+	if (crc32c_table.hardware) return ~crc32c_hardware(crc, p, len);
+#endif
+	const uint32_t (*t)[256] = crc32c_table.bytes;
+	for (; len >= 8; len -= 8, p += 8) // little endian only
+	{
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+		    ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	for (; len > 0; len--, p++) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+	return ~crc;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	uint32_t x = 1u << 31; // x^0
+	for (unsigned n = 3; len2 > 0; len2 >>= 1, n++) // multiply by x^(8 * len2)
+	{
+		if (len2 & 1) x = crc32c_multiply(crc32c_table.powers[n & 63], x);
+	}
+	return crc32c_multiply(x, crc1) ^ crc2;
+}
+
+uint32_t checksum(checksum_type type, const void* data, size_t len, unsigned threads)
+{
+	const size_t min_chunk = 4 * 1024 * 1024; // below this, starting a thread costs more than it saves
+	if (threads == 0) threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), std::max<size_t>(1, len / min_chunk));
+	const uint32_t init = (type == CHECKSUM_ADLER32) ? 1 : 0;
+	auto update = [type](uint32_t c, const uint8_t* p, size_t n) { return (type == CHECKSUM_ADLER32) ? adler32_update(c, p, n) : crc32c_update(c, p, n); };
+	if (threads <= 1 || len < 2 * min_chunk) return update(init, (const uint8_t*)data, len);
+
+	const size_t chunk = (len + threads - 1) / threads;
+	std::vector<uint32_t> parts(threads, init);
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++) // we do the first part ourselves
+	{
+		const size_t offset = std::min(len, i * chunk);
+		workers.emplace_back([&, i, offset] {
+			set_thread_name("checksum", THREAD_HELPER);
+			parts[i] = update(init, (const uint8_t*)data + offset, std::min(chunk, len - offset));
+		});
+	}
+	uint32_t result = update(init, (const uint8_t*)data, std::min(chunk, len));
+	for (std::thread& t : workers) t.join();
+	for (unsigned i = 1; i < threads; i++)
+	{
+		const size_t offset = std::min(len, i * chunk);
+		const size_t n = std::min(chunk, len - offset);
+		result = (type == CHECKSUM_ADLER32) ? adler32_combine(result, parts[i], n) : crc32c_combine(result, parts[i], n);
+	}
+	return result;
+}
+
 uint_fast32_t p__loops = get_env_int("TOOLSTEST_TIMES", 10);
 uint_fast8_t p__sanity = get_env_int("TOOLSTEST_SANITY", 0);
 uint_fast8_t p__debug_level = get_env_int("TOOLSTEST_DEBUG", 0);
 uint_fast8_t p__validation = get_env_int("TOOLSTEST_VALIDATION", 0);
 int_fast8_t p__device = get_env_int("TOOLSTEST_DEVICE", -1);
+std::string p__cpu_affinity = getenv("TOOLSTEST_AFFINITY") ? getenv("TOOLSTEST_AFFINITY") : "";
+std::string p__worker_affinity = getenv("TOOLSTEST_WORKER_AFFINITY") ? getenv("TOOLSTEST_WORKER_AFFINITY") : "";
+bool p__sched_fifo = get_env_int("TOOLSTEST_SCHED_FIFO", 0);
+std::string p__bench_timer = getenv("TOOLSTEST_BENCH_TIMER") ? getenv("TOOLSTEST_BENCH_TIMER") : "monotonic";
+cycle_timer p__cycle_timer;
+
+static uint32_t bench_ring_size = std::max(get_env_int("TOOLSTEST_BENCH_RING_SIZE", 4096), 1);
+static int bench_stream_batch = get_env_int("TOOLSTEST_BENCH_STREAM", 0);
+static int bench_counters_enabled = get_env_int("TOOLSTEST_BENCH_COUNTERS", 0);
+static int bench_warmup = std::max(get_env_int("TOOLSTEST_BENCH_WARMUP", 0), 0);
+static int bench_steady_window = std::max(get_env_int("TOOLSTEST_BENCH_STEADY", 0), 0);
+static int bench_steady_cv = get_env_int("TOOLSTEST_BENCH_STEADY_CV", 5); // in percent
+static std::atomic_uint64_t bench_next_id { 1 };
+thread_local bench_ring* bench_thread_ring = nullptr;
+thread_local uint64_t bench_thread_owner = 0;
+
+std::shared_ptr<bench_state> bench_create_state()
+{
+	std::shared_ptr<bench_state> state = std::make_shared<bench_state>();
+	state->id = bench_next_id++;
+	state->ring_size = bench_ring_size;
+	state->drain_at = bench_ring_size;
+	state->warmup = bench_warmup;
+	state->steady_window = bench_steady_window;
+	state->steady_cv = bench_steady_cv / 100.0;
+	state->steady_max = 20 * bench_steady_window;
+	return state;
+}
+
+static const struct { uint32_t type; uint64_t config; const char* name; } bench_counter_events[BENCH_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches" },
+};
+
+/// Open as many of our counters as we can as one group counting the calling thread. Counters that the system does not
+/// support, or does not allow us to use, are skipped; if none remain we only measure time.
+static void bench_counters_open(bench_ring* r)
+{
+	for (int i = 0; i < BENCH_COUNTERS; i++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = bench_counter_events[i].type;
+		attr.config = bench_counter_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		const int group = r->counter_fds.empty() ? -1 : r->counter_fds[0];
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+		if (fd < 0 && (errno == EACCES || errno == EPERM)) // try again without counting kernel work on our behalf
+		{
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+		}
+		if (fd < 0) { DLOG("Performance counter %s not available: %s", bench_counter_events[i].name, strerror(errno)); continue; }
+		r->counter_fds.push_back(fd);
+		r->counter_ids.push_back(i);
+	}
+	if (r->counter_fds.empty()) ILOG("No performance counters available - only measuring time");
+}
+
+static bool bench_counters_read(const bench_ring* r, bench_counters& out)
+{
+	uint64_t buf[1 + BENCH_COUNTERS]; // number of values, then the values in the order they were added to the group
+	const ssize_t size = read(r->counter_fds[0], buf, sizeof(buf));
+	if (size < (ssize_t)sizeof(uint64_t) || buf[0] != r->counter_ids.size()) return false;
+	for (unsigned i = 0; i < r->counter_ids.size(); i++) out.value[r->counter_ids[i]] = buf[1 + i];
+	return true;
+}
+
+void bench_counters_start(bench_ring* r)
+{
+	bench_counters_read(r, r->counter_start);
+}
+
+/// Add the counts of a thread to the shared per scene totals. Call with the state mutex held.
+static void bench_counters_flush(bench_state& st, bench_ring* r)
+{
+	if ((int)st.counters.size() <= r->counters_scene) st.counters.resize(r->counters_scene + 1);
+	for (int i = 0; i < BENCH_COUNTERS; i++) st.counters[r->counters_scene].value[i] += r->counters.value[i];
+	r->counters = bench_counters();
+}
+
+void bench_counters_stop(benchmarking& b, bench_ring* r, int scene)
+{
+	bench_counters now;
+	if (!bench_counters_read(r, now)) return;
+	if (__builtin_expect(scene != r->counters_scene, 0)) // only the shared totals grow, and only once per scene
+	{
+		std::lock_guard<std::mutex> lock(b.state->mutex);
+		bench_counters_flush(*b.state, r);
+		r->counters_scene = scene;
+	}
+	for (int id : r->counter_ids) r->counters.value[id] += now.value[id] - r->counter_start.value[id];
+}
+
+bool bench_warming_up(const bench_state& st, bench_ring* r, int scene, uint64_t duration)
+{
+	if (r->warm_count >= st.warmup + st.steady_max || (r->warm_count >= st.warmup && st.steady_window == 0))
+	{
+		if (st.steady_window > 0 && r->warm_count > st.warmup) ILOG("No steady state reached after discarding %u iterations, measuring anyway", (unsigned)r->warm_count);
+		r->warm = true;
+		r->warm_window.clear();
+		return false;
+	}
+	r->warm_count++;
+	if ((int)r->discarded.size() <= scene) r->discarded.resize(scene + 1, 0);
+	r->discarded[scene]++;
+	if (r->warm_count <= st.warmup || st.steady_window == 0) return true; // fixed warm-up phase
+
+	// Adaptive phase: discard until the latest steady_window durations have a low enough coefficient of variation
+	if (r->warm_window.size() == st.steady_window) r->warm_window.erase(r->warm_window.begin());
+	r->warm_window.push_back(duration);
+	if (r->warm_window.size() < st.steady_window) return true;
+	double mean = 0.0;
+	for (uint64_t v : r->warm_window) mean += v;
+	mean /= r->warm_window.size();
+	double variance = 0.0;
+	for (uint64_t v : r->warm_window) variance += (v - mean) * (v - mean);
+	variance /= r->warm_window.size();
+	if (mean > 0.0 && std::sqrt(variance) / mean > st.steady_cv) return true;
+	DLOG("Steady state reached after discarding %u iterations", (unsigned)r->warm_count);
+	r->warm = true;
+	r->warm_window.clear();
+	return true;
+}
+
+bench_ring::~bench_ring()
+{
+	for (int fd : counter_fds) close(fd);
+}
+
+bench_ring* bench_attach_thread(benchmarking& b)
+{
+	std::unique_ptr<bench_ring> r = std::make_unique<bench_ring>();
+	r->slots.resize(b.state->ring_size);
+	if (bench_counters_enabled) bench_counters_open(r.get());
+	bench_thread_ring = r.get();
+	bench_thread_owner = b.state->id;
+	std::lock_guard<std::mutex> lock(b.state->mutex);
+	for (int id : r->counter_ids) b.state->counters_valid |= 1u << id;
+	b.state->rings.push_back(std::move(r));
+	return bench_thread_ring;
+}
+
+static inline uint32_t bench_bucket(uint64_t value)
+{
+	if (value < BENCH_HISTOGRAM_SUB_COUNT) return value;
+	const uint32_t shift = 63 - __builtin_clzll(value) - BENCH_HISTOGRAM_SUB_BITS;
+	return (shift + 1) * BENCH_HISTOGRAM_SUB_COUNT + ((value >> shift) & (BENCH_HISTOGRAM_SUB_COUNT - 1));
+}
+
+static inline uint64_t bench_bucket_low(uint32_t bucket)
+{
+	if (bucket < BENCH_HISTOGRAM_SUB_COUNT) return bucket;
+	const uint32_t shift = bucket / BENCH_HISTOGRAM_SUB_COUNT - 1;
+	return (uint64_t)(BENCH_HISTOGRAM_SUB_COUNT + bucket % BENCH_HISTOGRAM_SUB_COUNT) << shift;
+}
+
+static inline uint64_t bench_bucket_high(uint32_t bucket) // inclusive
+{
+	if (bucket < BENCH_HISTOGRAM_SUB_COUNT) return bucket;
+	return bench_bucket_low(bucket) + (1ull << (bucket / BENCH_HISTOGRAM_SUB_COUNT - 1)) - 1;
+}
+
+void bench_stats_add(bench_stats& s, uint64_t value)
+{
+	if (s.buckets.empty()) s.buckets.resize(BENCH_HISTOGRAM_BUCKETS, 0);
+	s.buckets[bench_bucket(value)]++;
+	s.count++;
+	s.min = std::min(s.min, value);
+	s.max = std::max(s.max, value);
+	const double delta = (double)value - s.mean;
+	s.mean += delta / s.count;
+	s.m2 += delta * ((double)value - s.mean);
+}
+
+uint64_t bench_stats_percentile(const bench_stats& s, double percentile)
+{
+	if (s.count == 0) return 0;
+	const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(percentile / 100.0 * s.count));
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < s.buckets.size(); i++)
+	{
+		seen += s.buckets[i];
+		if (seen >= rank) return std::clamp((bench_bucket_low(i) + bench_bucket_high(i)) / 2, s.min, s.max);
+	}
+	return s.max;
+}
+
+/// Background writer of results as JSON lines, fed through a bounded queue
+struct bench_stream
+{
+	std::string path;
+	FILE* fp = nullptr;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond; // signalled on any change to queue or done
+	std::vector<result_t> queue; // reserved once, never grows beyond capacity
+	size_t capacity = 0;
+	bool done = false;
+	uint64_t written = 0;
+
+	~bench_stream() { stop(); }
+
+	void stop()
+	{
+		if (!thread.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		cond.notify_all();
+		thread.join();
+		fclose(fp);
+	}
+};
+
+static void bench_stream_writer(bench_stream* s)
+{
+	set_thread_name("bench-writer", THREAD_HELPER);
+	std::vector<result_t> batch;
+	batch.reserve(s->capacity);
+	std::unique_lock<std::mutex> lock(s->mutex);
+	while (true)
+	{
+		s->cond.wait(lock, [s] { return !s->queue.empty() || s->done; });
+		if (s->queue.empty()) break; // done, and all written
+		batch.swap(s->queue); // both keep their reservations
+		lock.unlock();
+		s->cond.notify_all(); // room for more
+		for (const result_t& v : batch)
+		{
+			fprintf(s->fp, "{\"scene_index\":%d,\"start_time\":%" PRIu64 ",\"stop_time\":%" PRIu64, v.scene, v.start, v.end);
+			if (v.gpu_end != 0) fprintf(s->fp, ",\"gpu_start\":%" PRIu64 ",\"gpu_stop\":%" PRIu64, v.gpu_start, v.gpu_end);
+			fprintf(s->fp, "}\n");
+		}
+		fflush(s->fp); // so that it survives us crashing
+		s->written += batch.size();
+		batch.clear();
+		lock.lock();
+	}
+}
+
+static void bench_stream_push(bench_stream& s, const result_t* first, const result_t* last)
+{
+	const size_t n = last - first;
+	std::unique_lock<std::mutex> lock(s.mutex);
+	s.cond.wait(lock, [&] { return s.queue.empty() || s.queue.size() + n <= s.capacity; }); // wait for the writer to catch up
+	s.queue.insert(s.queue.end(), first, last);
+	lock.unlock();
+	s.cond.notify_all();
+}
+
+void bench_scene_memory(benchmarking& b, bool scene_start)
+{
+	bench_state& st = *b.state;
+	const int scene = st.scene.load(std::memory_order_relaxed);
+	if ((int)st.memory.size() <= scene) st.memory.resize(scene + 1);
+	bench_memory& m = st.memory[scene];
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (scene_start)
+	{
+		st.scene_minor_faults = usage.ru_minflt;
+		st.scene_major_faults = usage.ru_majflt;
+		st.scene_sampled = true;
+	}
+	else
+	{
+		if (st.scene_sampled) // otherwise we would count faults since some unknown point
+		{
+			m.minor_faults += usage.ru_minflt - st.scene_minor_faults;
+			m.major_faults += usage.ru_majflt - st.scene_major_faults;
+		}
+		st.scene_sampled = false;
+		m.peak_rss = (uint64_t)usage.ru_maxrss * 1024; // in kilobytes on Linux
+		unsigned long size = 0;
+		unsigned long resident = 0;
+		FILE* fp = fopen("/proc/self/statm", "r");
+		if (fp && fscanf(fp, "%lu %lu", &size, &resident) == 2) m.rss = (uint64_t)resident * sysconf(_SC_PAGESIZE);
+		if (fp) fclose(fp);
+	}
+	if (st.memory_hook) st.memory_hook(m, scene_start, st.memory_hook_data);
+}
+
+void bench_stream_start(benchmarking& b)
+{
+	bench_state& st = *b.state;
+	if (bench_stream_batch <= 0 && !st.loop_forever) return;
+	std::shared_ptr<bench_stream> s = std::make_shared<bench_stream>();
+	s->path = b.results_file + ".jsonl";
+	s->fp = fopen(s->path.c_str(), "w");
+	if (!s->fp) ABORT("Failed to open benchmarking results stream %s: %s", s->path.c_str(), strerror(errno));
+	st.drain_at = std::min<uint32_t>((bench_stream_batch > 0) ? bench_stream_batch : 64, st.ring_size);
+	s->capacity = std::max<size_t>(st.ring_size, 4 * st.drain_at);
+	s->queue.reserve(s->capacity);
+	s->thread = std::thread(bench_stream_writer, s.get());
+	st.stream = s;
+	printf("Streaming benchmarking results to %s\n", s->path.c_str());
+}
+
+/// Pair a cycle counter reading with a gettime() reading, keeping the tightest of a few tries. Returns its uncertainty
+/// in nanoseconds.
+static uint64_t cycle_timer_sample(uint64_t& cycles, uint64_t& ns)
+{
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < 16; i++)
+	{
+		const uint64_t before = gettime();
+		const uint64_t c = read_cycles();
+		const uint64_t after = gettime();
+		if (after - before >= best) continue;
+		best = after - before;
+		cycles = c;
+		ns = before + best / 2;
+	}
+	return best;
+}
+
+static bool cycle_timer_calibrate(cycle_timer& t)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+	{
+		ELOG("No invariant TSC, so it cannot be used as a benchmarking timer");
+		return false;
+	}
+#elif !defined(__aarch64__)
+	ELOG("No known cycle counter for this CPU architecture");
+	return false;
+#endif
+	// Keep the best of a few short rounds, so that one preemption while sampling cannot skew the result
+	uint64_t c0 = 0, t0 = 0, c1 = 0, t1 = 0;
+	uint64_t best = UINT64_MAX;
+	for (int round = 0; round < 5; round++)
+	{
+		uint64_t rc0 = 0, rt0 = 0, rc1 = 0, rt1 = 0;
+		uint64_t error = cycle_timer_sample(rc0, rt0);
+		usleep(10000); // long enough for the error of good samples to be a few parts per million
+		error += cycle_timer_sample(rc1, rt1);
+		if (rc1 <= rc0 || rt1 <= rt0 || error >= best) continue;
+		best = error;
+		c0 = rc0; t0 = rt0; c1 = rc1; t1 = rt1;
+	}
+	if (c1 <= c0 || t1 <= t0)
+	{
+		ELOG("Cycle counter did not advance during calibration");
+		return false;
+	}
+	t.mult = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / (c1 - c0));
+	t.frequency = (uint64_t)((unsigned __int128)(c1 - c0) * 1000000000ull / (t1 - t0));
+	t.base_cycles = c1;
+	t.base_ns = t1;
+#if defined(__aarch64__)
+	uint64_t reported;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r" (reported));
+	if (reported && (t.frequency > reported + reported / 100 || t.frequency < reported - reported / 100))
+	{
+		ELOG("Measured cycle counter frequency %" PRIu64 " Hz differs from the reported %" PRIu64 " Hz", t.frequency, reported);
+	}
+#endif
+	return true;
+}
+
+void bench_timer_init(benchmarking& b)
+{
+	cycle_timer& t = p__cycle_timer;
+	t.enabled = false;
+	if (p__bench_timer == "cycles")
+	{
+		if (t.mult == 0 && cycle_timer_calibrate(t)) ILOG("Benchmarking timer calibrated: cycle counter at %" PRIu64 " Hz", t.frequency);
+		t.enabled = (t.mult != 0);
+	}
+	else if (p__bench_timer != "monotonic") ELOG("Unknown benchmarking timer %s - using monotonic", p__bench_timer.c_str());
+	b.run_info["timer"] = t.enabled ? "cycles" : "monotonic";
+	if (t.enabled) b.run_info["timer_frequency"] = std::to_string(t.frequency);
+}
+
+// Must be called with the state mutex held
+static void bench_account(bench_state& st, const result_t* first, const result_t* last)
+{
+	for (const result_t* v = first; v != last; v++)
+	{
+		if ((int)st.stats.size() <= v->scene) st.stats.resize(v->scene + 1);
+		bench_stats_add(st.stats[v->scene], v->end - v->start);
+		if (v->gpu_end == 0) continue;
+		if ((int)st.gpu_stats.size() <= v->scene) st.gpu_stats.resize(v->scene + 1);
+		bench_stats_add(st.gpu_stats[v->scene], v->gpu_end - v->gpu_start);
+	}
+	if (st.stream) bench_stream_push(*st.stream, first, last);
+	else st.drained.insert(st.drained.end(), first, last);
+}
+
+void bench_drain_ring(benchmarking& b, bench_ring* r)
+{
+	if (!b.state->stream) DLOG("Benchmarking result ring full after %u iterations, draining it", (unsigned)r->count);
+	std::lock_guard<std::mutex> lock(b.state->mutex);
+	bench_account(*b.state, r->slots.data(), r->slots.data() + r->count);
+	r->count = 0;
+}
+
+void bench_merge_results(benchmarking& b)
+{
+	std::lock_guard<std::mutex> lock(b.state->mutex);
+	for (auto& r : b.state->rings)
+	{
+		bench_account(*b.state, r->slots.data(), r->slots.data() + r->count);
+		r->count = 0;
+		if (!r->counter_fds.empty()) bench_counters_flush(*b.state, r.get());
+		if (b.state->discarded.size() < r->discarded.size()) b.state->discarded.resize(r->discarded.size(), 0);
+		for (unsigned scene = 0; scene < r->discarded.size(); scene++) b.state->discarded[scene] += r->discarded[scene];
+		r->discarded.clear();
+	}
+	if (b.state->stream) b.state->stream->stop();
+	b.results.insert(b.results.end(), b.state->drained.begin(), b.state->drained.end());
+	b.state->drained.clear();
+	std::stable_sort(b.results.begin(), b.results.end(), [](const result_t& a, const result_t& b) { return a.start < b.start; });
+}
+
+static nlohmann::json bench_summary(const bench_stats& s)
+{
+	nlohmann::json summary;
+	summary["count"] = s.count;
+	summary["min"] = s.min;
+	summary["max"] = s.max;
+	summary["mean"] = s.mean;
+	summary["stddev"] = (s.count > 1) ? std::sqrt(s.m2 / (s.count - 1)) : 0.0;
+	summary["median"] = bench_stats_percentile(s, 50.0);
+	summary["p90"] = bench_stats_percentile(s, 90.0);
+	summary["p95"] = bench_stats_percentile(s, 95.0);
+	summary["p99"] = bench_stats_percentile(s, 99.0);
+	summary["p99.9"] = bench_stats_percentile(s, 99.9);
+	nlohmann::json histogram = nlohmann::json::array();
+	for (uint32_t i = 0; i < s.buckets.size(); i++)
+	{
+		if (s.buckets[i] == 0) continue;
+		histogram.push_back({ { "low", bench_bucket_low(i) }, { "high", bench_bucket_high(i) }, { "count", s.buckets[i] } });
+	}
+	summary["histogram"] = histogram;
+	return summary;
+}
+
+static nlohmann::json bench_result(const benchmarking& b, const result_t& v)
+{
+	nlohmann::json result;
+	if (!b.scene_name.empty())
+	{
+		result["scene"] = b.scene_name.at(v.scene);
+		if ((int)b.scene_result_file.size() > v.scene && !b.scene_result_file.at(v.scene).empty())
+		{
+			result["output"] = b.scene_result_file.at(v.scene);
+			result["putput_type"] = "png";
+			result["validated"] = false;
+		}
+	}
+	result["start_time"] = v.start;
+	result["stop_time"] = v.end;
+	result["time"] = v.end - v.start;
+	if (v.gpu_end != 0)
+	{
+		result["gpu_start"] = v.gpu_start;
+		result["gpu_stop"] = v.gpu_end;
+		result["gpu_duration"] = v.gpu_end - v.gpu_start;
+	}
+	return result;
+}
 
 void bench_save_results_file(const benchmarking& b)
 {
-	printf("Writing benchmarking results file (%d iterations): %s\n", (int)b.results.size(), b.results_file.c_str());
+	const uint64_t iterations = b.state->stream ? b.state->stream->written : b.results.size();
+	printf("Writing benchmarking results file (%" PRIu64 " iterations): %s\n", iterations, b.results_file.c_str());
 	nlohmann::json data;
 	data["app_version"] = "1.0";
 	data["std_version"] = 1;
 	data["enable_file"] = nlohmann::json::parse(b.enable_file);
 	if (!b.backend_name.empty()) data["rendering_backend"] = b.backend_name;
 	data["init_time"] = b.init_time;
+	nlohmann::json run_info = nlohmann::json::object();
+	for (const auto& pair : b.run_info)
+	{
+		std::visit([&](const auto& v) { run_info[pair.first] = v; }, pair.second);
+	}
+	if (!run_info.empty()) data["run_info"] = run_info;
+	if (!b.state->image_hashes.empty())
+	{
+		nlohmann::json hashes = nlohmann::json::object();
+		char hex[17];
+		for (const auto& pair : b.state->image_hashes)
+		{
+			snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)pair.second);
+			hashes[pair.first] = hex;
+		}
+		data["image_hashes"] = hashes;
+	}
+	if (b.state->warmup > 0 || b.state->steady_window > 0)
+	{
+		uint64_t discarded = 0;
+		for (uint64_t v : b.state->discarded) discarded += v;
+		data["warmup"] = { { "iterations", b.state->warmup }, { "steady_window", b.state->steady_window }, { "steady_cv", b.state->steady_cv }, { "discarded", discarded } };
+	}
 	data["end_time"] = gettime();
-	nlohmann::json results = nlohmann::json::array();
-	for (const auto& v : b.results)
-	{
-		nlohmann::json result;
-		if (!b.scene_name.empty())
-		{
-			result["scene"] = b.scene_name.at(v.scene);
-			if ((int)b.scene_result_file.size() >= v.scene && !b.scene_result_file.at(v.scene).empty())
-			{
-				result["output"] = b.scene_result_file.at(v.scene);
-				result["putput_type"] = "png";
-				result["validated"] = false;
-			}
-		}
-		result["start_time"] = v.start;
-		result["stop_time"] = v.end;
-		result["time"] = v.end - v.start;
-		results.push_back(result);
-	}
-	data["results"] = results;
+	if (!b.state->stream)
+	{
+		nlohmann::json results = nlohmann::json::array();
+		for (const auto& v : b.results) results.push_back(bench_result(b, v));
+		data["results"] = results;
+	}
+	nlohmann::json summaries = nlohmann::json::array();
+	for (unsigned i = 0; i < b.state->stats.size(); i++)
+	{
+		if (b.state->stats[i].count == 0) continue;
+		nlohmann::json summary = bench_summary(b.state->stats[i]);
+		if (i < b.scene_name.size()) summary["scene"] = b.scene_name.at(i);
+		if (i < b.state->discarded.size() && b.state->discarded[i] > 0) summary["discarded"] = b.state->discarded[i];
+		if (i < b.state->gpu_stats.size() && b.state->gpu_stats[i].count > 0) summary["gpu"] = bench_summary(b.state->gpu_stats[i]);
+		if (i < b.state->counters.size() && b.state->counters_valid)
+		{
+			nlohmann::json counters; // totals over all iterations of the scene
+			for (int c = 0; c < BENCH_COUNTERS; c++) if (b.state->counters_valid & (1u << c)) counters[bench_counter_events[c].name] = b.state->counters[i].value[c];
+			summary["counters"] = counters;
+		}
+		if (i < b.state->memory.size() && b.state->memory[i].peak_rss > 0)
+		{
+			const bench_memory& m = b.state->memory[i];
+			nlohmann::json memory;
+			memory["rss"] = m.rss;
+			memory["peak_rss"] = m.peak_rss;
+			memory["minor_faults"] = m.minor_faults;
+			memory["major_faults"] = m.major_faults;
+			if (!m.device_live.empty()) memory["device_live"] = m.device_live;
+			if (!m.device_peak.empty()) memory["device_peak"] = m.device_peak;
+			if (!m.device_usage.empty()) memory["device_usage"] = m.device_usage;
+			summary["memory"] = memory;
+		}
+		summaries.push_back(summary);
+	}
+	data["summary"] = summaries;
 	std::ofstream file(b.results_file);
-	file << data.dump(4);
+	if (!b.state->stream)
+	{
+		file << data.dump(4);
+		file.close();
+		return;
+	}
+
+	// Fill in the results from the stream one at a time, so that we never hold all of them in memory
+	std::string head = data.dump(4);
+	head.resize(head.size() - 2); // remove the closing "\n}"
+	file << head << ",\n    \"results\": [";
+	std::ifstream in(b.state->stream->path);
+	std::string line;
+	bool first = true;
+	while (std::getline(in, line))
+	{
+		nlohmann::json record = nlohmann::json::parse(line, nullptr, false);
+		if (record.is_discarded()) { ELOG("Bad line in benchmarking results stream: %s", line.c_str()); continue; }
+		result_t v = { record.value("start_time", 0ull), record.value("stop_time", 0ull), record.value("scene_index", 0), record.value("gpu_start", 0ull), record.value("gpu_stop", 0ull) };
+		file << (first ? "\n        " : ",\n        ") << bench_result(b, v).dump();
+		first = false;
+	}
+	file << "\n    ]\n}";
 	file.close();
 }
 
-void set_thread_name(const char* name)
+void set_thread_name(const char* name, thread_role role)
 {
 	// "length is restricted to 16 characters, including the terminating null byte"
 	// http://man7.org/linux/man-pages/man3/pthread_setname_np.3.html
@@ -79,6 +842,124 @@ void set_thread_name(const char* name)
 #else
 	prctl(PR_SET_NAME, (unsigned long)name, 0, 0, 0);
 #endif
+	thread_setup(role);
+}
+
+/// Maximum frequency of each CPU, or empty if cpufreq is not available
+static std::vector<int> cpu_max_freqs()
+{
+	std::vector<int> freqs;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		FILE* fp = fopen(("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/cpuinfo_max_freq").c_str(), "r");
+		if (!fp) break;
+		int freq = 0;
+		if (fscanf(fp, "%d", &freq) != 1) freq = 0;
+		fclose(fp);
+		freqs.push_back(freq);
+	}
+	return freqs;
+}
+
+/// Parse a CPU list like "0-3,6", or "big", "little" or "all". Returns false on bad input.
+static bool parse_cpus(const std::string& spec, cpu_set_t& set)
+{
+	CPU_ZERO(&set);
+	const long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (spec == "all")
+	{
+		for (long cpu = 0; cpu < ncpus && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+		return true;
+	}
+	if (spec == "big" || spec == "little")
+	{
+		const std::vector<int> freqs = cpu_max_freqs();
+		if (freqs.empty()) { ELOG("No cpufreq information to find %s CPUs", spec.c_str()); return false; }
+		const int target = (spec == "big") ? *std::max_element(freqs.begin(), freqs.end()) : *std::min_element(freqs.begin(), freqs.end());
+		for (unsigned cpu = 0; cpu < freqs.size(); cpu++) if (freqs[cpu] == target) CPU_SET(cpu, &set);
+		return true;
+	}
+	const char* s = spec.c_str();
+	while (*s)
+	{
+		char* end = nullptr;
+		const long first = strtol(s, &end, 10);
+		if (end == s) return false;
+		long last = first;
+		if (*end == '-')
+		{
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s) return false;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+		for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &set);
+		if (*end == ',') end++;
+		else if (*end) return false;
+		s = end;
+	}
+	return CPU_COUNT(&set) > 0;
+}
+
+void thread_setup(thread_role role)
+{
+	const std::string& spec = (role == THREAD_MAIN) ? p__cpu_affinity : (role == THREAD_WORKER) ? p__worker_affinity : std::string();
+	if (!spec.empty())
+	{
+		cpu_set_t set;
+		if (!parse_cpus(spec, set)) ELOG("Bad CPU affinity: %s", spec.c_str());
+		else if (sched_setaffinity(0, sizeof(set), &set) != 0) ELOG("Failed to set CPU affinity %s: %s", spec.c_str(), strerror(errno));
+	}
+	if (role == THREAD_HELPER && (!p__cpu_affinity.empty() || !p__worker_affinity.empty()))
+	{
+		// Helper threads would otherwise inherit the mask of the pinned thread that started them, so move
+		// them to the CPUs not used for measuring, or to any CPU if there are none left
+		cpu_set_t all;
+		parse_cpus("all", all);
+		cpu_set_t set = all;
+		for (const std::string* measured : { &p__cpu_affinity, &p__worker_affinity })
+		{
+			cpu_set_t used;
+			if (measured->empty() || !parse_cpus(*measured, used)) continue;
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &used)) CPU_CLR(cpu, &set);
+		}
+		if (CPU_COUNT(&set) == 0) set = all;
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) ELOG("Failed to set helper thread CPU affinity: %s", strerror(errno));
+	}
+	if (role == THREAD_HELPER)
+	{
+		// Helper threads must not compete with the measured threads, so never let them inherit realtime priority
+		struct sched_param param = {};
+		sched_setscheduler(0, SCHED_OTHER, &param);
+	}
+	else if (p__sched_fifo)
+	{
+		struct sched_param param = {};
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) ELOG("Failed to set SCHED_FIFO: %s", strerror(errno));
+	}
+}
+
+void thread_setup_run_info(benchmarking& b)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		std::string cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (!CPU_ISSET(cpu, &set)) continue;
+			int last = cpu;
+			while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) last++;
+			if (!cpus.empty()) cpus += ",";
+			cpus += (last == cpu) ? std::to_string(cpu) : std::to_string(cpu) + "-" + std::to_string(last);
+			cpu = last;
+		}
+		b.run_info["cpu_affinity"] = cpus;
+	}
+	if (!p__worker_affinity.empty()) b.run_info["worker_affinity"] = p__worker_affinity;
+	b.run_info["sched_fifo"] = (sched_getscheduler(0) == SCHED_FIFO);
 }
 
 char keypress()
@@ -149,7 +1030,7 @@ bool exists_blob(const std::string& filename)
 	return (r == 0 && st.st_size > 0);
 }
 
-char* load_blob(const std::string& filename, uint32_t* size)
+char* load_blob(const std::string& filename, uint64_t* size)
 {
 	FILE* fp = fopen(filename.c_str(), "rb");
 	if (!fp)
@@ -160,23 +1041,94 @@ char* load_blob(const std::string& filename, uint32_t* size)
 	int r = fstat(fileno(fp), &st);
 	if (r != 0) ABORT("Could not stat \"%s\": %s", filename.c_str(), strerror(errno));
 	if (st.st_size == 0) ABORT("Trying to load blob of size zero!");
-	char* blob = (char*)malloc(st.st_size);
+	char* blob = (char*)malloc(st.st_size + 1);
+	if (!blob) ABORT("Out of memory loading \"%s\" (size %llu)", filename.c_str(), (unsigned long long)st.st_size);
 	r = fread(blob, st.st_size, 1, fp);
-	if (r != 1) ABORT("Could not read \"%s\" (size %d, returned %d): %s", filename.c_str(), (int)st.st_size, r, strerror(errno));
+	if (r != 1) ABORT("Could not read \"%s\" (size %llu, returned %d): %s", filename.c_str(), (unsigned long long)st.st_size, r, strerror(errno));
 	fclose(fp);
+	blob[st.st_size] = '\0';
 	*size = st.st_size;
 	return blob;
 }
 
-void save_blob(const std::string& filename, const char* data, uint32_t size)
+void save_blob(const std::string& filename, const char* data, uint64_t size)
 {
 	if (size == 0) ABORT("Trying to save blob of size zero!");
-	FILE* fp = fopen(filename.c_str(), "wb");
+	const std::string temp = filename + ".tmp" + std::to_string(getpid());
+	FILE* fp = fopen(temp.c_str(), "wb");
 	if (!fp)
 	{
-		ABORT("Cannot open \"%s\": %s", filename.c_str(), strerror(errno));
+		ABORT("Cannot open \"%s\": %s", temp.c_str(), strerror(errno));
 	}
-	int r = fwrite(data, size, 1, fp);
-	if (r != 1) ABORT("Could not write \"%s\" (size %d, returned %d): %s", filename.c_str(), (int)size, r, strerror(errno));
-	fclose(fp);
+	bool ok = fwrite(data, size, 1, fp) == 1;
+	ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0; // make sure the contents hit the disk before the rename does
+	const int error = errno;
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok)
+	{
+		unlink(temp.c_str());
+		ABORT("Could not write \"%s\" (size %llu): %s", temp.c_str(), (unsigned long long)size, strerror(error));
+	}
+	if (rename(temp.c_str(), filename.c_str()) != 0)
+	{
+		const int rename_error = errno;
+		unlink(temp.c_str());
+		ABORT("Could not rename \"%s\" to \"%s\": %s", temp.c_str(), filename.c_str(), strerror(rename_error));
+	}
+}
+
+mapped_blob::mapped_blob(const std::string& filename)
+{
+	const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) ABORT("Cannot open \"%s\": %s", filename.c_str(), strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) != 0) ABORT("Could not stat \"%s\": %s", filename.c_str(), strerror(errno));
+	if (st.st_size == 0) ABORT("Trying to load blob of size zero!");
+	size = st.st_size;
+	void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr != MAP_FAILED)
+	{
+		madvise(ptr, size, MADV_SEQUENTIAL); // we read it once from start to end
+		madvise(ptr, size, MADV_WILLNEED); // so start reading ahead right away
+		data = (const char*)ptr;
+		mapped = true;
+	}
+	else // eg for pipes, fall back to reading it
+	{
+		DLOG("Could not map \"%s\", reading it instead: %s", filename.c_str(), strerror(errno));
+		char* copy = (char*)malloc(size);
+		if (!copy) ABORT("Out of memory loading \"%s\" (size %llu)", filename.c_str(), (unsigned long long)size);
+		uint64_t done = 0;
+		while (done < size)
+		{
+			const ssize_t r = read(fd, copy + done, size - done);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) ABORT("Could not read \"%s\" (size %llu): %s", filename.c_str(), (unsigned long long)size, strerror(errno));
+			done += r;
+		}
+		data = copy;
+	}
+	close(fd); // the mapping keeps its own reference to the file
+}
+
+mapped_blob& mapped_blob::operator=(mapped_blob&& other)
+{
+	if (this == &other) return *this;
+	release();
+	data = other.data;
+	size = other.size;
+	mapped = other.mapped;
+	other.data = nullptr;
+	other.size = 0;
+	other.mapped = false;
+	return *this;
+}
+
+void mapped_blob::release()
+{
+	if (mapped) munmap((void*)data, size);
+	else free((void*)data);
+	data = nullptr;
+	size = 0;
+	mapped = false;
 }
@@ -14,16 +14,35 @@
 #include <assert.h>
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <variant>
+#include <unordered_map>
 #include <stdint.h>
 
-/// Implement support for naming threads, missing from c++11
-void set_thread_name(const char* name);
+/// What a thread is used for, which decides its CPU placement
+enum thread_role
+{
+	THREAD_MAIN, // the main test thread
+	THREAD_WORKER, // other threads doing measured work
+	THREAD_HELPER, // threads doing bookkeeping, eg writing results; never pinned or given realtime priority
+};
+
+/// Implement support for naming threads, missing from c++11. Also applies the thread placement for the given role.
+void set_thread_name(const char* name, thread_role role = THREAD_WORKER);
+/// Apply the configured CPU affinity and scheduling policy for the given role to the calling thread.
+void thread_setup(thread_role role);
 
 extern uint_fast32_t p__loops;
 extern uint_fast8_t p__sanity;
 extern uint_fast8_t p__debug_level;
 extern uint_fast8_t p__validation;
 extern int_fast8_t p__device;
+extern std::string p__cpu_affinity; // CPUs for the main thread, eg "0-3,6", "big" or "little"; empty to not pin
+extern std::string p__worker_affinity; // as above, for worker threads
+extern bool p__sched_fifo; // request SCHED_FIFO for the main and worker threads
+extern std::string p__bench_timer; // benchmarking iteration timer, "monotonic" or "cycles"
 
 #ifdef ANDROID
 #include <sstream>
@@ -60,18 +79,6 @@ int STOI(const std::string& value);
 
 #else // !ANDROID
 
-static __attribute__((pure)) inline uint32_t adler32(unsigned char *data, size_t len)
-{
-	const uint32_t MOD_ADLER = 65521;
-	uint32_t a = 1, b = 0;
-	for (size_t index = 0; index < len; ++index)
-	{
-		a = (a + data[index]) % MOD_ADLER;
-		b = (b + a) % MOD_ADLER;
-	}
-	return (b << 16) | a;
-}
-
 static __attribute__((pure)) inline uint64_t gettime()
 {
 	struct timespec t;
@@ -83,6 +90,51 @@ static __attribute__((pure)) inline uint64_t gettime()
 	return ((uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec);
 }
 
+/// Cheap but low resolution (typically a few milliseconds) version of the above, in the same time domain. Good
+/// enough for deadlines.
+static inline uint64_t gettime_coarse()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	return ((uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec);
+}
+
+/// Raw CPU cycle counter: the TSC on x86, the virtual counter on AArch64. Zero if there is none.
+static inline uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("lfence; rdtsc" : "=a" (lo), "=d" (hi) :: "memory"); // lfence stops it being read early
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (v) :: "memory");
+	return v;
+#else
+	return 0;
+#endif
+}
+
+/// Conversion of the cycle counter into the time domain of gettime(), set up by bench_timer_init()
+struct cycle_timer
+{
+	bool enabled = false; // if set, benchmarking iterations are timed with the cycle counter
+	uint64_t base_cycles = 0; // cycle counter and gettime() at the calibration point
+	uint64_t base_ns = 0;
+	uint64_t mult = 0; // nanoseconds per cycle in 32.32 fixed point
+	uint64_t frequency = 0; // cycles per second
+};
+extern cycle_timer p__cycle_timer;
+
+/// Time in nanoseconds for benchmarking iterations. Same time domain as gettime(), but much cheaper to read if the
+/// cycles benchmarking timer is selected.
+static inline uint64_t bench_gettime()
+{
+	if (__builtin_expect(!p__cycle_timer.enabled, 1)) return gettime();
+	const uint64_t delta = read_cycles() - p__cycle_timer.base_cycles;
+	return p__cycle_timer.base_ns + (uint64_t)(((unsigned __int128)delta * p__cycle_timer.mult) >> 32);
+}
+
 #ifndef NDEBUG
 /// Using DLOGn() instead of DLOG(n,...) so that we can conditionally compile without some of them
 #define DLOG3(_format, ...) do { if (p__debug_level >= 3) { fprintf(stdout, "%s:%d " _format "\n", __FILE__, __LINE__, ## __VA_ARGS__); } } while(0)
@@ -115,36 +167,261 @@ struct result_t
 	uint64_t start;
 	uint64_t end;
 	int scene;
+	uint64_t gpu_start; // zero if no GPU timestamps were collected for this iteration
+	uint64_t gpu_end;
+};
+
+/// Performance counters sampled around each iteration if TOOLSTEST_BENCH_COUNTERS is set and the system lets us
+enum bench_counter { BENCH_CYCLES, BENCH_INSTRUCTIONS, BENCH_CACHE_MISSES, BENCH_BRANCH_MISSES, BENCH_PAGE_FAULTS, BENCH_CONTEXT_SWITCHES, BENCH_COUNTERS };
+
+struct bench_counters
+{
+	uint64_t value[BENCH_COUNTERS] = {};
+};
+
+/// Preallocated per-thread storage of iteration results. Only the owning thread ever writes to it, so recording
+/// needs no locks. When it fills up, the owning thread moves its contents over to the shared results list.
+struct bench_ring
+{
+	std::vector<result_t> slots; // sized once on creation, never grows
+	uint32_t count = 0; // number of slots in use
+	uint64_t start = 0; // start time of the latest iteration on this thread
+	uint64_t gpu_start = 0; // GPU time span of the latest iteration on this thread, if any
+	uint64_t gpu_end = 0;
+	std::vector<int> counter_fds; // perf event group of this thread, leader first; empty if counters are unavailable
+	std::vector<int> counter_ids; // which bench_counter each of the above counts
+	bench_counters counter_start; // values at the start of the latest iteration
+	bench_counters counters; // counted on this thread so far for counters_scene, not yet added to the shared totals
+	int counters_scene = 0;
+	bool warm = false; // done warming up on this thread
+	uint32_t warm_count = 0; // iterations discarded while warming up
+	std::vector<uint64_t> warm_window; // durations of the latest of those, for steady state detection
+	std::vector<uint64_t> discarded; // per scene, iterations discarded while warming up
+
+	~bench_ring();
+};
+
+/// Log-linear (HDR style) histogram buckets: values below 2^BENCH_HISTOGRAM_SUB_BITS get an exact bucket each, above
+/// that every power of two is split into 2^BENCH_HISTOGRAM_SUB_BITS buckets, giving a relative error of at most ~3%.
+#define BENCH_HISTOGRAM_SUB_BITS 5
+#define BENCH_HISTOGRAM_SUB_COUNT (1u << BENCH_HISTOGRAM_SUB_BITS)
+#define BENCH_HISTOGRAM_BUCKETS ((64 - BENCH_HISTOGRAM_SUB_BITS + 1) * BENCH_HISTOGRAM_SUB_COUNT)
+
+/// Running statistics of iteration durations for one scene.
+struct bench_stats
+{
+	uint64_t count = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	double mean = 0.0;
+	double m2 = 0.0; // sum of squared distances from the mean, for Welford's algorithm
+	std::vector<uint32_t> buckets; // histogram, allocated on first use
+};
+
+void bench_stats_add(bench_stats& s, uint64_t value);
+/// Approximate value at the given percentile [0, 100], from the histogram.
+uint64_t bench_stats_percentile(const bench_stats& s, double percentile);
+
+/// Memory footprint of a scene
+struct bench_memory
+{
+	uint64_t rss = 0; // bytes resident when the scene last stopped
+	uint64_t peak_rss = 0; // bytes, peak of the process up to then
+	uint64_t minor_faults = 0; // during the scene
+	uint64_t major_faults = 0;
+	std::vector<uint64_t> device_live; // per heap, bytes of device memory live when the scene last stopped, from a memory_hook
+	std::vector<uint64_t> device_peak; // per heap, highest of the above during the scene
+	std::vector<uint64_t> device_usage; // per heap, the driver's view of all of our device memory use, if it can tell us
+};
+
+struct benchmarking;
+struct bench_stream;
+
+/// Shared between copies of the same benchmarking struct.
+struct bench_state
+{
+	uint64_t id = 0; // unique for each instance, used to validate thread local ring caches
+	std::mutex mutex; // protects rings and drained
+	std::vector<std::unique_ptr<bench_ring>> rings;
+	std::vector<result_t> drained; // contents of rings that ran full
+	std::vector<bench_stats> stats; // per scene, updated whenever results are moved out of a ring
+	std::vector<bench_stats> gpu_stats; // as above, for GPU durations
+	std::vector<bench_counters> counters; // per scene, totals of all threads, filled in when merging results
+	uint32_t counters_valid = 0; // bitmask of the bench_counter values opened on at least one thread
+	std::vector<bench_memory> memory; // per scene
+	uint64_t scene_minor_faults = 0; // process fault counts when the current scene started
+	uint64_t scene_major_faults = 0;
+	bool scene_sampled = false; // if the above were taken for the current scene and it has not stopped yet
+	void (*memory_hook)(bench_memory& m, bool scene_start, void* data) = nullptr; // fills in device memory use, eg for Vulkan
+	void* memory_hook_data = nullptr;
+	std::atomic_int scene { 0 }; // index of the current scene
+	uint32_t ring_size = 0;
+	uint32_t drain_at = 0; // drain a ring when it holds this many results, lower than ring_size when streaming
+	std::shared_ptr<bench_stream> stream; // if set, results are streamed to file instead of kept in memory
+	std::vector<std::pair<std::string, uint64_t>> image_hashes; // name and content hash of each saved image, in save order; protected by mutex
+	void (*stop_hook)(benchmarking& b, void* data) = nullptr; // run on every iteration stop, eg to collect GPU timestamps
+	void* stop_hook_data = nullptr;
+	uint64_t loop_time = 0; // nanoseconds to loop for, from the loop_time capability, or zero
+	bool loop_forever = false; // from a loops capability of zero
+	uint64_t loop_count = 0; // loop iterations started in the current loop
+	uint64_t loop_deadline = 0;
+	uint64_t loop_discarded = 0; // iterations discarded while warming up before the current loop started
+	uint32_t warmup = 0; // iterations to always discard on each thread before recording any
+	uint32_t steady_window = 0; // if set, then keep discarding until this many iterations in a row are steady
+	double steady_cv = 0.0; // coefficient of variation under which we consider the window steady
+	uint32_t steady_max = 0; // give up on reaching a steady state after discarding this many iterations
+	std::vector<uint64_t> discarded; // per scene, totals of all threads, filled in when merging results
+	uint64_t frame_time = 16666667; // simulated nanoseconds per frame, from the fixed_framerate capability
+	uint64_t frame = 0; // frames simulated so far
 };
+
+std::shared_ptr<bench_state> bench_create_state();
+
 struct benchmarking
 {
-	std::vector<result_t> results; // store all results
+	std::vector<result_t> results; // store all results, merged from the thread rings in bench_done()
 	uint64_t init_time = 0; // to track start of whole run
-	uint64_t latest_time = 0; // if we need it, to track start of latest iteration
 	char* enable_file = nullptr; // copy of the enable file for the results file
 	std::string test_name;
 	std::string results_file; // path to results file
 	std::vector<std::string> scene_name;
 	std::vector<std::string> scene_result_file;
 	std::string backend_name;
+	std::unordered_map<std::string, std::variant<int, bool, std::string>> run_info; // free-form information about the run
+	std::shared_ptr<bench_state> state = bench_create_state();
 };
 
+extern thread_local bench_ring* bench_thread_ring; // this thread's ring, valid only if bench_thread_owner matches
+extern thread_local uint64_t bench_thread_owner;
+
 void bench_save_results_file(const benchmarking& b);
+/// Slow path of bench_ring_for(): creates and registers a ring for the calling thread.
+bench_ring* bench_attach_thread(benchmarking& b);
+/// Move the contents of a full ring into the shared drained list.
+void bench_drain_ring(benchmarking& b, bench_ring* r);
+/// Merge all thread rings into the results list, sorted by start time. When streaming, flush them to the stream
+/// instead and close it.
+void bench_merge_results(benchmarking& b);
+/// Out of line parts of bench_start_iteration() and bench_stop_iteration() when counters are in use.
+void bench_counters_start(bench_ring* r);
+void bench_counters_stop(benchmarking& b, bench_ring* r, int scene);
+/// Warm-up bookkeeping of bench_stop_iteration(). Returns true if the iteration should be discarded.
+bool bench_warming_up(const bench_state& st, bench_ring* r, int scene, uint64_t duration);
+/// Record the memory footprint of the current scene as it starts or stops. Page faults are only counted for a stop
+/// that has a matching start.
+void bench_scene_memory(benchmarking& b, bool scene_start);
+/// Start streaming results to a JSON lines file next to the results file if TOOLSTEST_BENCH_STREAM is set or we
+/// are looping forever, so that memory use stays constant and results survive a crash.
+void bench_stream_start(benchmarking& b);
+/// Set up the benchmarking timer selected in p__bench_timer, calibrating the cycle counter against gettime()
+/// the first time it is asked for, and record the choice in the run information.
+void bench_timer_init(benchmarking& b);
+/// Record the placement actually applied to the calling thread in the run information of the results file.
+void thread_setup_run_info(benchmarking& b);
+
+static inline bench_ring* bench_ring_for(benchmarking& b)
+{
+	if (__builtin_expect(bench_thread_owner == b.state->id, 1)) return bench_thread_ring;
+	return bench_attach_thread(b);
+}
+
 static inline void bench_init(benchmarking& b, const char* test_name, char* enable_file, const char* results_file)
 {
 	b.test_name = test_name;
+	bench_timer_init(b);
 	b.init_time = gettime();
 	b.enable_file = enable_file;
 	b.results_file = results_file;
+	bench_stream_start(b);
+	bench_ring_for(b); // preallocate for the main thread
+	if (b.enable_file) bench_scene_memory(b, true); // baseline, in case the test never starts a scene
 }
 static inline void bench_done(benchmarking& b)
 {
+	if (b.enable_file && b.state->scene_sampled) bench_scene_memory(b, false); // scene never stopped, or no scenes at all
+	bench_merge_results(b);
 	if (b.enable_file) { bench_save_results_file(b); free(b.enable_file); }
 }
-static inline void bench_start_iteration(benchmarking& b) { b.latest_time = gettime(); }
-static inline void bench_stop_iteration(benchmarking& b) { b.results.push_back({ b.latest_time, gettime(), std::max<int>(0, (int)b.scene_name.size() - 1) }); }
-static inline void bench_start_scene(benchmarking& b, const std::string& scene_name) { b.scene_name.push_back(scene_name); }
-static inline void bench_stop_scene(benchmarking& b, const std::string& filename = std::string()) { b.scene_result_file.push_back(filename); }
+/// Call from a worker thread before its timed loop to avoid paying for ring creation inside of it. Optional.
+static inline void bench_thread_init(benchmarking& b) { bench_ring_for(b); }
+static inline void bench_start_iteration(benchmarking& b)
+{
+	bench_ring* r = bench_ring_for(b);
+	if (!r->counter_fds.empty()) bench_counters_start(r);
+	r->start = bench_gettime();
+}
+static inline void bench_stop_iteration(benchmarking& b)
+{
+	const uint64_t now = bench_gettime();
+	bench_ring* r = bench_ring_for(b);
+	const int scene = b.state->scene.load(std::memory_order_relaxed);
+	if (__builtin_expect(!r->warm, 0) && bench_warming_up(*b.state, r, scene, now - r->start))
+	{
+		if (b.state->stop_hook) b.state->stop_hook(b, b.state->stop_hook_data); // discard any GPU timings as well
+		r->gpu_start = 0;
+		r->gpu_end = 0;
+		return;
+	}
+	if (!r->counter_fds.empty()) bench_counters_stop(b, r, scene);
+	if (b.state->stop_hook) b.state->stop_hook(b, b.state->stop_hook_data);
+	r->slots[r->count++] = { r->start, now, scene, r->gpu_start, r->gpu_end };
+	r->gpu_start = 0;
+	r->gpu_end = 0;
+	if (__builtin_expect(r->count >= b.state->drain_at, 0)) bench_drain_ring(b, r);
+}
+/// Attach a GPU time span to the current iteration of this thread. Call before bench_stop_iteration().
+static inline void bench_gpu_iteration(benchmarking& b, uint64_t gpu_start, uint64_t gpu_end)
+{
+	bench_ring* r = bench_ring_for(b);
+	r->gpu_start = gpu_start;
+	r->gpu_end = gpu_end;
+}
+/// Main loop control, honouring the loops and loop_time benchmarking capabilities. Call before every iteration of the
+/// loop, eg while (bench_loop(vulkan.bench)) { ... }. Without capabilities it runs the given number of iterations,
+/// not counting those discarded while warming up.
+static inline bool bench_loop(const benchmarking& b, uint64_t loops = p__loops)
+{
+	bench_state& st = *b.state;
+	const uint32_t discarded = (bench_thread_owner == st.id) ? bench_thread_ring->warm_count : 0;
+	bool more;
+	if (st.loop_count == 0) st.loop_discarded = discarded;
+	if (st.loop_count == 0 && st.loop_time > 0) st.loop_deadline = gettime_coarse() + st.loop_time;
+	if (st.loop_deadline > 0) more = gettime_coarse() < st.loop_deadline;
+	else more = st.loop_forever || st.loop_count < loops + (discarded - st.loop_discarded);
+	if (more) st.loop_count++;
+	else { st.loop_count = 0; st.loop_deadline = 0; } // ready for the next loop
+	return more;
+}
+/// Simulated time in seconds of the current frame. Animate from this rather than from wall clock time, so that the
+/// same frames are rendered no matter how fast we run.
+static inline double bench_sim_time(const benchmarking& b)
+{
+	return (b.state->frame * b.state->frame_time) / 1000000000.0;
+}
+/// Advance the simulated clock by one frame
+static inline void bench_next_frame(const benchmarking& b)
+{
+	b.state->frame++;
+}
+static inline void bench_start_scene(benchmarking& b, const std::string& scene_name)
+{
+	// Repeating the previous scene without it having output of its own just adds another iteration of it
+	if (!b.scene_name.empty() && b.scene_name.back() == scene_name && b.scene_result_file.size() == b.scene_name.size() && b.scene_result_file.back().empty())
+	{
+		b.scene_result_file.pop_back();
+	}
+	else
+	{
+		b.scene_name.push_back(scene_name);
+		b.state->scene.store((int)b.scene_name.size() - 1, std::memory_order_relaxed);
+	}
+	if (b.enable_file) bench_scene_memory(b, true);
+}
+static inline void bench_stop_scene(benchmarking& b, const std::string& filename = std::string())
+{
+	if (b.enable_file) bench_scene_memory(b, false);
+	b.scene_result_file.push_back(filename);
+}
 
 static inline bool is_debug() { return p__debug_level; }
 char keypress();
@@ -152,10 +429,53 @@ bool match(const char* in, const char* short_form, const char* long_form);
 int get_arg(char** in, int i, int argc);
 const char* get_string_arg(char** in, int i, int argc);
 void usage();
-char* load_blob(const std::string& filename, uint32_t* size);
-void save_blob(const std::string& filename, const char* data, uint32_t size);
+/// Read a whole file into a malloc'ed copy, with a terminating zero byte past the end for text files. Aborts on failure.
+char* load_blob(const std::string& filename, uint64_t* size);
+/// Write a file atomically by writing a temporary file next to it and renaming it over. Aborts on failure.
+void save_blob(const std::string& filename, const char* data, uint64_t size);
 bool exists_blob(const std::string& filename);
 
+/// Read-only view of a whole file, memory mapped if possible so that large files load without copying. Aborts on failure.
+struct mapped_blob
+{
+	const char* data = nullptr;
+	uint64_t size = 0;
+
+	mapped_blob() {}
+	explicit mapped_blob(const std::string& filename);
+	mapped_blob(const mapped_blob&) = delete;
+	mapped_blob& operator=(const mapped_blob&) = delete;
+	mapped_blob(mapped_blob&& other) { *this = std::move(other); }
+	mapped_blob& operator=(mapped_blob&& other);
+	~mapped_blob() { release(); }
+	void release();
+
+private:
+	bool mapped = false; // else data is malloc'ed
+};
+
 int get_env_int(const char* name, int fallback);
 
+/// Fast non-cryptographic 64 bit hash of the data, compatible with XXH64
+uint64_t hash64(const void* data, size_t len, uint64_t seed = 0);
+
+/// Buffer checksums that can be computed in parts and combined, see checksum()
+enum checksum_type
+{
+	CHECKSUM_ADLER32, // what the trace helper asserts use
+	CHECKSUM_CRC32C, // hardware accelerated where available
+};
+/// Continue an Adler-32 checksum, which starts at 1
+uint32_t adler32_update(uint32_t adler, const void* data, size_t len);
+/// Continue a CRC32C (Castagnoli) checksum, which starts at 0
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len);
+/// Checksum of the concatenation of two blocks, from the checksums of each and the length of the second
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+/// Checksum of the data, split across helper threads for large inputs. The result is the same for any
+/// number of threads; zero picks it from the size and the number of CPUs.
+uint32_t checksum(checksum_type type, const void* data, size_t len, unsigned threads = 0);
+/// Adler-32 checksum, the same as vkAssertBufferARM and glAssertBuffer_ARM return
+static __attribute__((pure)) inline uint32_t adler32(unsigned char *data, size_t len) { return adler32_update(1, data, len); }
+
 static __attribute__((const)) inline uint64_t aligned_size(uint64_t size, uint64_t alignment) { return size + alignment - 1ull - (size + alignment - 1ull) % alignment; }
@@ -0,0 +1,56 @@
+// Unit checks of the helpers in util.cpp that do not need a GPU
+
+#include "util.h"
+
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK_EQ(_a, _b) do { const uint64_t a = (_a); const uint64_t b = (_b); if (a != b) { ELOG("%s is %llx, expected %llx", #_a, (unsigned long long)a, (unsigned long long)b); failures++; } } while(0)
+
+static void test_checksums()
+{
+	CHECK_EQ(crc32c_update(0, "123456789", 9), 0xe3069283); // the standard check value
+	CHECK_EQ(crc32c_update(0, "", 0), 0);
+	CHECK_EQ(adler32((unsigned char*)"Wikipedia", 9), 0x11e60398);
+	CHECK_EQ(adler32((unsigned char*)"", 0), 1);
+
+	std::vector<uint8_t> data(9 * 1024 * 1024 + 13); // big enough to be split across threads
+	uint32_t x = 12345;
+	for (uint8_t& v : data) { x = x * 1103515245 + 12345; v = x >> 24; }
+	const uint32_t adler = adler32(data.data(), data.size());
+	const uint32_t crc = crc32c_update(0, data.data(), data.size());
+
+	for (size_t split : { (size_t)0, (size_t)1, (size_t)7, (size_t)5552, (size_t)65536, data.size() - 3, data.size() })
+	{
+		const size_t rest = data.size() - split;
+		CHECK_EQ(adler32_combine(adler32(data.data(), split), adler32(data.data() + split, rest), rest), adler);
+		CHECK_EQ(crc32c_combine(crc32c_update(0, data.data(), split), crc32c_update(0, data.data() + split, rest), rest), crc);
+		CHECK_EQ(crc32c_update(crc32c_update(0, data.data(), split), data.data() + split, rest), crc);
+	}
+
+	for (unsigned threads : { 0u, 1u, 2u, 3u, 7u })
+	{
+		CHECK_EQ(checksum(CHECKSUM_ADLER32, data.data(), data.size(), threads), adler);
+		CHECK_EQ(checksum(CHECKSUM_CRC32C, data.data(), data.size(), threads), crc);
+	}
+}
+
+static void test_hash64()
+{
+	// reference values of XXH64
+	CHECK_EQ(hash64("", 0), 0xef46db3751d8e999ull);
+	CHECK_EQ(hash64("a", 1), 0xd24ec4f1a98c6e5bull);
+	CHECK_EQ(hash64("abc", 3), 0x44bc2cf5ad770999ull);
+	const char* text = "Nobody inspects the spammish repetition"; // long enough for the four lane loop
+	CHECK_EQ(hash64(text, strlen(text)), 0xfbcea83c8a378bf1ull);
+}
+
+int main()
+{
+	test_checksums();
+	test_hash64();
+	if (failures) ELOG("%d checks failed", failures);
+	else printf("All checks passed\n");
+	return failures ? 1 : 0;
+}
@@ -148,6 +148,7 @@ int main(int argc, char** argv)
 	bench_stop_iteration(vulkan.bench);
 
 	output_buffer.map();
+	output_buffer.invalidate();
 	const uint32_t* output_data = reinterpret_cast<const uint32_t*>(output_buffer.m_mappedAddress);
 	bool ok = true;
 	for (uint32_t i = 0; i < kOutputCount; ++i)
@@ -81,21 +81,21 @@ int main(int argc, char** argv)
 	result = vkMapMemory(vulkan.device, memory, 0, 1024, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
 	memset(data, 0xdeadfeed, 1024);
-	orig_crc_parent = adler32((unsigned char*)data, 1024);
+	orig_crc_parent = checksum(CHECKSUM_ADLER32, data, 1024);
 	if (flush_variant == 1 || vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 0, 1024, flush_variant != 1);
 	vkUnmapMemory(vulkan.device, memory);
 
 	result = vkMapMemory(vulkan.device, memory, 256, 256, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
 	memset(data, 0xabcdabcd, 256);
-	orig_crc_child = adler32((unsigned char*)data, 256);
+	orig_crc_child = checksum(CHECKSUM_ADLER32, data, 256);
 	if (flush_variant == 1 || vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 256, 256, flush_variant != 1);
 	vkUnmapMemory(vulkan.device, memory);
 
 	result = vkMapMemory(vulkan.device, memory, 512, 256, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
 	memset(data, 0xdeafbeef, 256);
-	orig_crc_alien = adler32((unsigned char*)data, 256);
+	orig_crc_alien = checksum(CHECKSUM_ADLER32, data, 256);
 	if (flush_variant == 1 || vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 512, 256, flush_variant != 1);
 	vkUnmapMemory(vulkan.device, memory);
 
@@ -83,21 +83,21 @@ int main(int argc, char** argv)
 	result = vkMapMemory(vulkan.device, memory, 0, 1024, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
 	memset(data, 0xdeadfeed, 1024);
-	orig_crc_child_1 = adler32((unsigned char*)data, 1024);
+	orig_crc_child_1 = checksum(CHECKSUM_ADLER32, data, 1024);
 	if (flush_variant == 1 || vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 0, 1024, flush_variant != 1);
 	vkUnmapMemory(vulkan.device, memory);
 
 	result = vkMapMemory(vulkan.device, memory, 512, 1536, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
 	memset(data, 0xabcdabcd, 1536);
-	orig_crc_child_2 = adler32((unsigned char*)data, 1536);
+	orig_crc_child_2 = checksum(CHECKSUM_ADLER32, data, 1536);
 	if (flush_variant == 1 || vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 512, 1536, flush_variant != 1);
 	vkUnmapMemory(vulkan.device, memory);
 
 	// remap child_1 buffer to see if overlapping buffer child_2 has modified it
 	result = vkMapMemory(vulkan.device, memory, 0, 1024, 0, (void**)&data);
 	assert(result == VK_SUCCESS);
-	latest_crc_child_1 = adler32((unsigned char*)data, 1024);
+	latest_crc_child_1 = checksum(CHECKSUM_ADLER32, data, 1024);
 	vkUnmapMemory(vulkan.device, memory);
 
 	assert(latest_crc_child_1 != orig_crc_child_1);
@@ -410,10 +410,11 @@ void prepare_acceleration_structures(const vulkan_setup_t & vulkan, Resources &
 
 			check(vkMapMemory(vulkan.device, resources.blas_buffer.memory, 0, build_size_info.accelerationStructureSize, 0, &data_original_blas));
 			check(vkMapMemory(vulkan.device, resources.copied_blas_buffer.memory, 0, build_size_info.accelerationStructureSize, 0, &data_copy_blas));
+			testInvalidateMemory(vulkan, resources.blas_buffer.memory, 0, build_size_info.accelerationStructureSize);
 
 			memcpy(data_copy_blas, data_original_blas, build_size_info.accelerationStructureSize);  // Adjust the size if necessary
 
-			if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, resources.copied_blas_buffer.memory, 0, build_size_info.accelerationStructureSize, true);
+			if (test_needs_flush(vulkan)) testFlushMemory(vulkan, resources.copied_blas_buffer.memory, 0, build_size_info.accelerationStructureSize, true);
 			vkUnmapMemory(vulkan.device, resources.blas_buffer.memory);
 			vkUnmapMemory(vulkan.device, resources.copied_blas_buffer.memory);
 			break;
@@ -620,7 +621,7 @@ void prepare_shader_binding_table(const vulkan_setup_t & vulkan, Resources & res
 	void * mapped = nullptr;
 	vkMapMemory(vulkan.device, resources.ray_gen_shader_binding_table.memory, 0, handle_size, 0, &mapped);
 	memcpy(mapped, shader_handle_storage.data(), handle_size);
-	if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, resources.ray_gen_shader_binding_table.memory, 0, handle_size, true);
+	if (test_needs_flush(vulkan)) testFlushMemory(vulkan, resources.ray_gen_shader_binding_table.memory, 0, handle_size, true);
 	vkUnmapMemory(vulkan.device, resources.ray_gen_shader_binding_table.memory);
 }
 
@@ -1,13 +1,48 @@
 #include "vulkan_common.h"
 #include "external/json.hpp"
 #include <fstream>
+#include <algorithm>
+#include <inttypes.h>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <condition_variable>
 #include <spirv/unified1/spirv.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "external/stb_image_write.h"
 
 static VkPhysicalDeviceMemoryProperties memory_properties = {};
+static uint32_t memory_type_masks[512] = {}; // memory types that have all of the property flags of the index
+static std::vector<uint32_t> memory_type_ranks[TEST_MEMORY_STRATEGIES]; // memory types in order of preference, per strategy
+static const char* memory_strategy_names[TEST_MEMORY_STRATEGIES] = { "device_local", "streaming", "readback" };
 static int no_explicit = 0;
+static int gpu_timestamps = get_env_int("TOOLSTEST_GPU_TIMESTAMPS", 0);
+static const uint32_t gpu_timer_slots = 64;
+static int image_threads = get_env_int("TOOLSTEST_IMAGE_THREADS", 2);
+
+/// How test_save_image() stores images
+enum image_format_t
+{
+	IMAGE_FORMAT_PNG, // zlib compressed, slow to write
+	IMAGE_FORMAT_QOI, // lossless and much faster to write, see https://qoiformat.org
+	IMAGE_FORMAT_RAW, // RGBA8 pixels as-is, with the size in the file name
+	IMAGE_FORMAT_HASH, // no file, only a hash of the RGBA8 pixels in the results
+	IMAGE_FORMATS
+};
+static image_format_t image_format = IMAGE_FORMAT_PNG;
+static const char* image_format_names[IMAGE_FORMATS] = { "png", "qoi", "raw", "hash" };
+
+static std::mutex memory_tracking_mutex;
+static std::unordered_map<VkDeviceMemory, std::pair<uint32_t, VkDeviceSize>> memory_tracking; // heap and size of each live allocation
+static std::vector<uint64_t> memory_live; // per heap
+static std::vector<uint64_t> memory_peak; // per heap, since the current scene started
+static VkPhysicalDevice memory_budget_physical = VK_NULL_HANDLE; // set if we can query VK_EXT_memory_budget
 
 static VkBool32 messenger_callback(
     VkDebugUtilsMessageSeverityFlagBitsEXT           messageSeverity,
@@ -53,12 +88,289 @@ void test_marker_mention(const vulkan_setup_t& vulkan, const std::string& text,
 
 void testFreeMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory)
 {
+	test_track_memory_free(memory);
 	vkFreeMemory(vulkan.device, memory, nullptr);
 }
 
+void test_track_memory_alloc(VkDeviceMemory memory, uint32_t memoryTypeIndex, VkDeviceSize size)
+{
+	const uint32_t heap = memory_properties.memoryTypes[memoryTypeIndex].heapIndex;
+	std::lock_guard<std::mutex> lock(memory_tracking_mutex);
+	if (memory_live.size() <= heap) return; // not tracking
+	memory_tracking[memory] = { heap, size };
+	memory_live[heap] += size;
+	memory_peak[heap] = std::max(memory_peak[heap], memory_live[heap]);
+}
+
+void test_track_memory_free(VkDeviceMemory memory)
+{
+	std::lock_guard<std::mutex> lock(memory_tracking_mutex);
+	auto it = memory_tracking.find(memory);
+	if (it == memory_tracking.end()) return;
+	memory_live[it->second.first] -= it->second.second;
+	memory_tracking.erase(it);
+}
+
+static void memory_tracking_hook(bench_memory& m, bool scene_start, void* data)
+{
+	std::lock_guard<std::mutex> lock(memory_tracking_mutex);
+	if (scene_start)
+	{
+		memory_peak = memory_live;
+		return;
+	}
+	m.device_live = memory_live;
+	m.device_peak.resize(memory_peak.size(), 0);
+	for (unsigned i = 0; i < memory_peak.size(); i++) m.device_peak[i] = std::max(m.device_peak[i], memory_peak[i]);
+	if (memory_budget_physical != VK_NULL_HANDLE)
+	{
+		VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, nullptr };
+		VkPhysicalDeviceMemoryProperties2 mprops = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, &budget };
+		vkGetPhysicalDeviceMemoryProperties2(memory_budget_physical, &mprops);
+		m.device_usage.assign(budget.heapUsage, budget.heapUsage + mprops.memoryProperties.memoryHeapCount);
+	}
+}
+
+/// Read back the calling thread's pending timer slots, and add those submitted during its current iteration to its time span
+static void gpu_timer_read(gpu_timer_t& t)
+{
+	const uint64_t iteration_start = bench_thread_ring ? bench_thread_ring->start : 0;
+	const std::thread::id self = std::this_thread::get_id();
+	uint32_t mine[gpu_timer_slots];
+	uint32_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(t.mutex);
+		for (uint32_t slot = 0; slot < t.owners.size(); slot++) if (t.owners[slot] == self) mine[count++] = slot;
+	}
+	if (count == 0) return;
+	// Other threads leave our slots alone, so wait for the GPU without holding the lock
+	gpu_timer_t::span_t span;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint32_t slot = mine[i];
+		uint64_t ts[2];
+		VkResult result = vkGetQueryPoolResults(t.device, t.pool, slot * 2, 2, sizeof(ts), ts, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+		check(result);
+		if (t.submitted[slot] < iteration_start) continue; // left over from before this iteration, eg setup work
+		const uint64_t start = (ts[0] - t.gpu_base) & t.masks[slot];
+		span.start = std::min(span.start, start);
+		span.end = std::max(span.end, start + ((ts[1] - ts[0]) & t.masks[slot]));
+	}
+	std::lock_guard<std::mutex> lock(t.mutex);
+	for (uint32_t i = 0; i < count; i++) t.owners[mine[i]] = std::thread::id();
+	if (span.start == UINT64_MAX) return;
+	gpu_timer_t::span_t& total = t.spans[self];
+	total.start = std::min(total.start, span.start);
+	total.end = std::max(total.end, span.end);
+}
+
+static void gpu_timer_stop_hook(benchmarking& b, void* data)
+{
+	gpu_timer_t& t = *(gpu_timer_t*)data;
+	gpu_timer_read(t);
+	gpu_timer_t::span_t span;
+	{
+		std::lock_guard<std::mutex> lock(t.mutex);
+		auto it = t.spans.find(std::this_thread::get_id());
+		if (it == t.spans.end()) return; // nothing timed by this thread during this iteration
+		std::swap(span, it->second);
+	}
+	if (span.start == UINT64_MAX) return;
+	bench_gpu_iteration(b, t.cpu_base + (uint64_t)(span.start * t.period), t.cpu_base + (uint64_t)(span.end * t.period));
+}
+
+/// Create the timer command buffers for a queue family. Called with the timer mutex held.
+static gpu_timer_t::family_t& gpu_timer_family(gpu_timer_t& t, uint32_t family)
+{
+	auto it = t.families.find(family);
+	if (it != t.families.end()) return it->second;
+	gpu_timer_t::family_t& f = t.families[family];
+
+	VkCommandPoolCreateInfo cmdpoolinfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
+	cmdpoolinfo.queueFamilyIndex = family;
+	VkResult result = vkCreateCommandPool(t.device, &cmdpoolinfo, nullptr, &f.command_pool);
+	check(result);
+
+	VkCommandBufferAllocateInfo cmdinfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
+	cmdinfo.commandPool = f.command_pool;
+	cmdinfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	cmdinfo.commandBufferCount = gpu_timer_slots;
+	f.begin.resize(gpu_timer_slots);
+	f.end.resize(gpu_timer_slots);
+	result = vkAllocateCommandBuffers(t.device, &cmdinfo, f.begin.data());
+	check(result);
+	result = vkAllocateCommandBuffers(t.device, &cmdinfo, f.end.data());
+	check(result);
+
+	// Record once, reuse for every submit
+	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+	for (uint32_t i = 0; i < gpu_timer_slots; i++)
+	{
+		result = vkBeginCommandBuffer(f.begin[i], &beginInfo);
+		check(result);
+		vkCmdResetQueryPool(f.begin[i], t.pool, i * 2, 2);
+		vkCmdWriteTimestamp(f.begin[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, t.pool, i * 2);
+		result = vkEndCommandBuffer(f.begin[i]);
+		check(result);
+		result = vkBeginCommandBuffer(f.end[i], &beginInfo);
+		check(result);
+		vkCmdWriteTimestamp(f.end[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, t.pool, i * 2 + 1);
+		result = vkEndCommandBuffer(f.end[i]);
+		check(result);
+	}
+	return f;
+}
+
+static void gpu_timer_create(vulkan_setup_t& vulkan, const std::vector<VkQueueFamilyProperties>& families, const char* calibration_extension)
+{
+	std::vector<uint32_t> valid_bits(families.size(), 0);
+	bool any = false;
+	for (uint32_t i = 0; i < families.size(); i++)
+	{
+		// Resetting queries in a command buffer needs a graphics or compute queue
+		if (!(families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) continue;
+		valid_bits[i] = families[i].timestampValidBits;
+		if (valid_bits[i] == 0) ILOG("GPU timestamps not supported on queue family %u - not timing GPU work submitted to it", i);
+		any = any || valid_bits[i] > 0;
+	}
+	if (!any || vulkan.device_properties.limits.timestampPeriod == 0.0f)
+	{
+		ILOG("GPU timestamps not supported - not timing GPU work");
+		return;
+	}
+	vulkan.gpu_timer = std::make_shared<gpu_timer_t>();
+	gpu_timer_t& t = *vulkan.gpu_timer;
+	t.device = vulkan.device;
+	t.period = vulkan.device_properties.limits.timestampPeriod;
+	t.valid_bits = valid_bits;
+	t.owners.resize(gpu_timer_slots);
+	t.submitted.resize(gpu_timer_slots);
+	t.masks.resize(gpu_timer_slots);
+
+	VkQueryPoolCreateInfo qpinfo = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr };
+	qpinfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	qpinfo.queryCount = gpu_timer_slots * 2;
+	VkResult result = vkCreateQueryPool(vulkan.device, &qpinfo, nullptr, &t.pool);
+	check(result);
+	test_set_name(vulkan, VK_OBJECT_TYPE_QUERY_POOL, (uint64_t)t.pool, "GPU timer query pool");
+
+	// Translate into the CPU time domain of our iteration timings if we can
+	const bool khr = calibration_extension && strcmp(calibration_extension, VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0;
+	PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsKHR pGetTimeDomains = nullptr;
+	PFN_vkGetCalibratedTimestampsKHR pGetCalibratedTimestamps = nullptr;
+	if (calibration_extension)
+	{
+		pGetTimeDomains = (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsKHR)vkGetInstanceProcAddr(vulkan.instance, khr ? "vkGetPhysicalDeviceCalibrateableTimeDomainsKHR" : "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+		pGetCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsKHR)vkGetDeviceProcAddr(vulkan.device, khr ? "vkGetCalibratedTimestampsKHR" : "vkGetCalibratedTimestampsEXT");
+	}
+	if (pGetTimeDomains && pGetCalibratedTimestamps)
+	{
+		uint32_t count = 0;
+		result = pGetTimeDomains(vulkan.physical, &count, nullptr);
+		check(result);
+		std::vector<VkTimeDomainKHR> domains(count);
+		result = pGetTimeDomains(vulkan.physical, &count, domains.data());
+		check(result);
+		const bool has_device = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_KHR) != domains.end();
+		const bool has_monotonic = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_KHR) != domains.end();
+		if (has_device && has_monotonic)
+		{
+			VkCalibratedTimestampInfoKHR infos[2] = { { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR, nullptr }, { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR, nullptr } };
+			infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_KHR;
+			infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_KHR;
+			uint64_t timestamps[2];
+			uint64_t deviation = 0;
+			result = pGetCalibratedTimestamps(vulkan.device, 2, infos, timestamps, &deviation);
+			check(result);
+			t.gpu_base = timestamps[0];
+			t.cpu_base = timestamps[1];
+			t.calibrated = true;
+			ILOG("GPU timestamps calibrated against CLOCK_MONOTONIC (max deviation %" PRIu64 " ns)", deviation);
+		}
+	}
+	if (!t.calibrated) ILOG("GPU timestamps not calibrated - reporting them in the device time domain");
+	vulkan.bench.run_info["gpu_timestamps"] = t.calibrated ? "calibrated" : "device";
+	vulkan.bench.state->stop_hook = gpu_timer_stop_hook;
+	vulkan.bench.state->stop_hook_data = &t;
+}
+
+static void gpu_timer_destroy(vulkan_setup_t& vulkan)
+{
+	if (!vulkan.gpu_timer) return;
+	gpu_timer_t& t = *vulkan.gpu_timer;
+	if (vulkan.bench.state->stop_hook_data == &t)
+	{
+		vulkan.bench.state->stop_hook = nullptr;
+		vulkan.bench.state->stop_hook_data = nullptr;
+	}
+	for (auto& pair : t.families) vkDestroyCommandPool(vulkan.device, pair.second.command_pool, nullptr);
+	vkDestroyQueryPool(vulkan.device, t.pool, nullptr);
+	vulkan.gpu_timer = nullptr;
+}
+
+/// Find a free slot starting from the last one handed out and give it to the calling thread, or return -1 if all are taken
+static int gpu_timer_claim(gpu_timer_t& t, uint32_t family, VkCommandBuffer& begin, VkCommandBuffer& end)
+{
+	std::lock_guard<std::mutex> lock(t.mutex);
+	const uint32_t slots = t.owners.size();
+	for (uint32_t i = 0; i < slots; i++)
+	{
+		const uint32_t slot = (t.next + i) % slots;
+		if (t.owners[slot] != std::thread::id()) continue;
+		const gpu_timer_t::family_t& f = gpu_timer_family(t, family);
+		t.next = (slot + 1) % slots;
+		t.owners[slot] = std::this_thread::get_id();
+		t.submitted[slot] = gettime();
+		t.masks[slot] = (t.valid_bits[family] >= 64) ? UINT64_MAX : ((1ull << t.valid_bits[family]) - 1);
+		begin = f.begin[slot];
+		end = f.end[slot];
+		return slot;
+	}
+	return -1;
+}
+
+void test_gpu_timer_wrap(const vulkan_setup_t& vulkan, VkQueue queue, std::vector<VkCommandBuffer>& cmdbufs)
+{
+	if (!vulkan.gpu_timer) return;
+	gpu_timer_t& t = *vulkan.gpu_timer;
+	const uint32_t family = test_queue_family(vulkan, queue);
+	if (family >= t.valid_bits.size() || t.valid_bits[family] == 0) return; // cannot time work on this queue
+	VkCommandBuffer begin = VK_NULL_HANDLE;
+	VkCommandBuffer end = VK_NULL_HANDLE;
+	if (gpu_timer_claim(t, family, begin, end) < 0)
+	{
+		gpu_timer_read(t); // all slots in use, make room by collecting our own
+		if (gpu_timer_claim(t, family, begin, end) < 0) return; // all held by other threads, leave this submit untimed
+	}
+	cmdbufs.insert(cmdbufs.begin(), begin);
+	cmdbufs.push_back(end);
+}
+
+static void test_arena_destroy(vulkan_setup_t& vulkan);
+static void submit_contexts_destroy(vulkan_setup_t& vulkan);
+static void sync_pool_destroy(vulkan_setup_t& vulkan);
+static void image_encoder_finish();
+static void memory_policy_init(vulkan_setup_t& vulkan);
+static char* arena_mapping(const vulkan_setup_t& vulkan, VkDeviceMemory memory);
+
 void test_done(vulkan_setup_t& vulkan, bool shared_instance)
 {
 	bench_done(vulkan.bench);
+	gpu_timer_destroy(vulkan);
+	submit_contexts_destroy(vulkan);
+	sync_pool_destroy(vulkan);
+	image_encoder_finish();
+	test_arena_destroy(vulkan);
+	if (vulkan.bench.state->memory_hook == memory_tracking_hook)
+	{
+		vulkan.bench.state->memory_hook = nullptr;
+		std::lock_guard<std::mutex> lock(memory_tracking_mutex);
+		memory_tracking.clear();
+		memory_live.clear();
+		memory_peak.clear();
+		memory_budget_physical = VK_NULL_HANDLE;
+	}
 	vkDestroyDevice(vulkan.device, nullptr);
 	vulkan.device = VK_NULL_HANDLE;
 
@@ -99,10 +411,63 @@ static void print_usage(const vulkan_req_t& reqs)
 	if (reqs.minApiVersion <= VK_API_VERSION_1_3 && reqs.maxApiVersion >= VK_API_VERSION_1_3) printf("\t3 - Vulkan 1.3\n");
 	if (reqs.minApiVersion <= VK_API_VERSION_1_4 && reqs.maxApiVersion >= VK_API_VERSION_1_4) printf("\t4 - Vulkan 1.4\n");
 	printf("-neu/--no-explicit     Do not use the explicit host updates extension (default %d)\n", no_explicit);
+	printf("-gt/--gpu-timestamps   Also time benchmarked GPU work with timestamp queries (default %d)\n", gpu_timestamps);
+	printf("-af/--affinity CPUS    Pin the main thread to the given CPUs, eg 0-3,6 or big or little\n");
+	printf("-waf/--worker-affinity CPUS Pin worker threads to the given CPUs\n");
+	printf("-fifo/--sched-fifo     Run the main and worker threads with SCHED_FIFO scheduling\n");
+	printf("-sa/--suballocate      Sub-allocate the memory of the common helpers from a device memory arena\n");
+	printf("-tl/--timeline         Wait on a timeline semaphore per queue instead of fences, if supported\n");
+	printf("-if/--image-format F   How to store saved images: png (default), qoi, raw or hash to only record a hash of each\n");
+	if (!reqs.scenes.empty())
+	{
+		printf("-sc/--scene NAME       Run the given scene, can be repeated; or all to run every scene\n");
+		for (const test_scene& scene : reqs.scenes) printf("\t%s - %s\n", scene.name.c_str(), scene.description.c_str());
+	}
 	if (reqs.usage) reqs.usage();
 	exit(1);
 }
 
+static bool select_scene(vulkan_req_t& reqs, const std::string& name)
+{
+	for (unsigned i = 0; i < reqs.scenes.size(); i++)
+	{
+		if (name == "all") reqs.active_scenes.push_back(i);
+		else if (name == reqs.scenes.at(i).name) { reqs.active_scenes.push_back(i); return true; }
+	}
+	if (name == "all" && !reqs.scenes.empty()) return true;
+	ELOG("No such scene: %s", name.c_str());
+	return false;
+}
+
+/// Apply the options of a scene as if they were given on the command line
+static void apply_scene_options(vulkan_req_t& reqs, const test_scene& scene)
+{
+	std::vector<char*> argv;
+	for (const std::string& arg : scene.args) argv.push_back(const_cast<char*>(arg.c_str()));
+	const int argc = argv.size();
+	for (int i = 0; i < argc; i++)
+	{
+		if (!reqs.cmdopt || !reqs.cmdopt(i, argc, argv.data(), reqs)) ABORT("Invalid option for scene %s: %s", scene.name.c_str(), argv[i]);
+	}
+}
+
+void test_run_scenes(vulkan_setup_t& vulkan, vulkan_req_t& reqs, const std::function<void(const std::string& scene)>& body)
+{
+	if (reqs.active_scenes.empty())
+	{
+		body(std::string());
+		return;
+	}
+	for (unsigned index : reqs.active_scenes)
+	{
+		const test_scene& scene = reqs.scenes.at(index);
+		ILOG("Running scene %s", scene.name.c_str());
+		apply_scene_options(reqs, scene);
+		test_marker(vulkan, "Scene " + scene.name);
+		body(scene.name);
+	}
+}
+
 bool enable_frame_boundary(vulkan_req_t& reqs)
 {
 	if (reqs.options.count("frame_boundary") > 0) // this will fail badly if we run it twice
@@ -132,7 +497,7 @@ static bool check_bench(vulkan_setup_t& vulkan, vulkan_req_t& reqs, const char*
 	if (enable_path)
 	{
 		printf("Reading benchmarking enable file: %s\n", enable_path);
-		uint32_t size = 0;
+		uint64_t size = 0;
 		content = load_blob(enable_path, &size);
 	}
 	else if (enable_json)
@@ -153,7 +518,22 @@ static bool check_bench(vulkan_setup_t& vulkan, vulkan_req_t& reqs, const char*
 		reqs.fence_delay = caps.value("gpu_delay_reuse", 0);
 		if (caps.count("frameless") && caps.value("frameless", true) == false) enable_frame_boundary(reqs);
 		p__loops = caps.value("loops", p__loops);
-		// TBD: gpu_no_coherent
+		if (caps.count("loops") && p__loops == 0) vulkan.bench.state->loop_forever = true;
+		vulkan.bench.state->loop_time = caps.value("loop_time", 0.0) * 1000000000.0;
+		if (caps.count("fixed_framerate") && caps.at("fixed_framerate").is_number() && caps.value("fixed_framerate", 0.0) > 0.0)
+		{
+			vulkan.bench.state->frame_time = caps.value("fixed_framerate", 0.0) * 1000000.0; // given in milliseconds
+		}
+		vulkan.no_coherent = caps.value("gpu_no_coherent", false);
+	}
+
+	if (data.count("scenes"))
+	{
+		for (const auto& scene : data.at("scenes"))
+		{
+			if (!scene.is_string()) { WLOG("Ignoring non-string scene in benchmarking enable file: %s", scene.dump().c_str()); continue; }
+			if (!select_scene(reqs, scene.get<std::string>())) WLOG("Ignoring scene %s from benchmarking enable file", scene.get<std::string>().c_str());
+		}
 	}
 
 	if (data.count("settings"))
@@ -171,6 +551,10 @@ static bool check_bench(vulkan_setup_t& vulkan, vulkan_req_t& reqs, const char*
 		}
 
 		if (settings.count("queue_count")) reqs.queues = settings.value("queue_count", 1);
+		if (settings.count("cpu_affinity")) p__cpu_affinity = settings.value("cpu_affinity", "");
+		if (settings.count("worker_affinity")) p__worker_affinity = settings.value("worker_affinity", "");
+		if (settings.count("sched_fifo")) p__sched_fifo = settings.value("sched_fifo", false);
+		if (settings.count("bench_timer")) p__bench_timer = settings.value("bench_timer", "monotonic");
 	}
 	bench_init(vulkan.bench, testname, content, data.value("results", "results.json").c_str());
 
@@ -236,6 +620,42 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 		{
 			no_explicit = 1;
 		}
+		else if (match(argv[i], "-gt", "--gpu-timestamps"))
+		{
+			gpu_timestamps = 1;
+		}
+		else if (match(argv[i], "-af", "--affinity"))
+		{
+			p__cpu_affinity = get_string_arg(argv, ++i, argc);
+		}
+		else if (match(argv[i], "-waf", "--worker-affinity"))
+		{
+			p__worker_affinity = get_string_arg(argv, ++i, argc);
+		}
+		else if (match(argv[i], "-fifo", "--sched-fifo"))
+		{
+			p__sched_fifo = true;
+		}
+		else if (match(argv[i], "-sa", "--suballocate"))
+		{
+			reqs.suballocate = true;
+		}
+		else if (match(argv[i], "-tl", "--timeline"))
+		{
+			reqs.timeline = true;
+		}
+		else if (match(argv[i], "-if", "--image-format"))
+		{
+			const char* name = get_string_arg(argv, ++i, argc);
+			int f = 0;
+			while (f < IMAGE_FORMATS && strcmp(name, image_format_names[f]) != 0) f++;
+			if (f == IMAGE_FORMATS) { ELOG("Unknown image format: %s", name); print_usage(reqs); }
+			image_format = (image_format_t)f;
+		}
+		else if (match(argv[i], "-sc", "--scene"))
+		{
+			if (!select_scene(reqs, get_string_arg(argv, ++i, argc))) print_usage(reqs);
+		}
 		else if (match(argv[i], "-V", "--vulkan-variant")) // overrides version req from test itself
 		{
 			int vulkan_variant = get_arg(argv, ++i, argc);
@@ -277,6 +697,12 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 		print_usage(reqs);
 	}
 
+	// Apply the options of all scenes up front, so that the instance and device meet the requirements of every one of them
+	for (unsigned index : reqs.active_scenes) apply_scene_options(reqs, reqs.scenes.at(index));
+
+	thread_setup(THREAD_MAIN);
+	if (vulkan.bench.enable_file) thread_setup_run_info(vulkan.bench);
+
 	std::unordered_set<std::string> instance_required(reqs.instance_extensions.begin(), reqs.instance_extensions.end()); // temp copy
 	std::unordered_set<std::string> device_required(reqs.device_extensions.begin(), reqs.device_extensions.end()); // temp copy
 	vulkan.instance_extensions.insert(reqs.instance_extensions.begin(), reqs.instance_extensions.end()); // permanent copy
@@ -419,12 +845,14 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 	vulkan.physical = physical_devices.at(selected_gpu);
 
 	uint32_t family_count = 0;
+	std::vector<VkQueueFamilyProperties> families;
 	if (vulkan.apiVersion > VK_API_VERSION_1_2) // requirement is 1.1 but want to test both and nobody would run 1.0 anymore
 	{
 		vkGetPhysicalDeviceQueueFamilyProperties2(vulkan.physical, &family_count, nullptr);
 		std::vector<VkQueueFamilyProperties2> familyprops(family_count);
 		for (uint32_t i = 0; i < family_count; i++) familyprops[i].sType = VK_STRUCTURE_TYPE_QUEUE_FAMILY_PROPERTIES_2;
 		vkGetPhysicalDeviceQueueFamilyProperties2(vulkan.physical, &family_count, familyprops.data());
+		for (const VkQueueFamilyProperties2& props : familyprops) families.push_back(props.queueFamilyProperties);
 		if (familyprops[0].queueFamilyProperties.queueCount < reqs.queues)
 		{
 			printf("Vulkan implementation does not have sufficient queues (only %d, need %u) for this test\n", familyprops[0].queueFamilyProperties.queueCount, reqs.queues);
@@ -436,6 +864,7 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 		vkGetPhysicalDeviceQueueFamilyProperties(vulkan.physical, &family_count, nullptr);
 		std::vector<VkQueueFamilyProperties> familyprops(family_count);
 		vkGetPhysicalDeviceQueueFamilyProperties(vulkan.physical, &family_count, familyprops.data());
+		families = familyprops;
 		if (familyprops[0].queueCount < reqs.queues)
 		{
 			printf("Vulkan implementation does not have sufficient queues (only %d, need %u) for this test\n", familyprops[0].queueCount, reqs.queues);
@@ -461,6 +890,12 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 		if (reqs.reqfeat12.bufferDeviceAddress && !vulkan.hasfeat12.bufferDeviceAddress) { printf("Buffer device address extension feature required but not supported!\n"); exit(77); }
 		if (reqs.bufferDeviceAddress && !vulkan.hasfeat12.bufferDeviceAddress) { printf("Buffer device address required but not supported!\n"); exit(77); }
 		if (vulkan.hasfeat13.synchronization2 == VK_TRUE) reqs.reqfeat13.synchronization2 = VK_TRUE;
+		if (reqs.timeline && reqs.apiVersion >= VK_API_VERSION_1_2 && vulkan.hasfeat12.timelineSemaphore)
+		{
+			reqs.reqfeat12.timelineSemaphore = VK_TRUE;
+			vulkan.sync->timeline = true;
+		}
+		else if (reqs.timeline) ILOG("Timeline semaphores need Vulkan 1.2 and support for them - waiting on fences instead");
 	}
 	else // vulkan 1.0 mode
 	{
@@ -484,15 +919,38 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 	std::vector<VkLayerProperties> layer_info(layer_count);
 	vkEnumerateInstanceLayerProperties(&layer_count, layer_info.data());
 
+	// Pick queue families for the roles asked for, lowest index first
+	for (uint32_t i = 1; i < families.size() && reqs.async_compute; i++)
+	{
+		const VkQueueFlags flags = families[i].queueFlags;
+		if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) { vulkan.compute_family = i; break; }
+	}
+	for (uint32_t i = 1; i < families.size() && reqs.dedicated_transfer; i++)
+	{
+		const VkQueueFlags flags = families[i].queueFlags;
+		if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) { vulkan.transfer_family = i; break; }
+	}
+	if (reqs.async_compute && vulkan.compute_family == 0) ILOG("No compute queue family without graphics - using the graphics queue for compute");
+	if (reqs.dedicated_transfer && vulkan.transfer_family == 0) ILOG("No dedicated transfer queue family - using the graphics queue for transfers");
+
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	VkDeviceQueueCreateInfo queueCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, nullptr };
 	queueCreateInfo.queueFamilyIndex = 0; // just grab first one
 	queueCreateInfo.queueCount = reqs.queues;
 	std::vector<float> queuePriorities(reqs.queues);
 	std::fill(queuePriorities.begin(), queuePriorities.end(), 1.0f);
 	queueCreateInfo.pQueuePriorities = queuePriorities.data();
+	queueCreateInfos.push_back(queueCreateInfo);
+	for (uint32_t family : { vulkan.compute_family, vulkan.transfer_family })
+	{
+		if (family == 0) continue;
+		queueCreateInfo.queueFamilyIndex = family;
+		queueCreateInfo.queueCount = 1;
+		queueCreateInfos.push_back(queueCreateInfo);
+	}
 	VkDeviceCreateInfo deviceInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO, nullptr };
-	deviceInfo.queueCreateInfoCount = 1;
-	deviceInfo.pQueueCreateInfos = &queueCreateInfo;
+	deviceInfo.queueCreateInfoCount = queueCreateInfos.size();
+	deviceInfo.pQueueCreateInfos = queueCreateInfos.data();
 	deviceInfo.enabledLayerCount = 0;
 	deviceInfo.ppEnabledLayerNames = nullptr;
 	if (reqs.samplerAnisotropy) reqs.reqfeat2.features.samplerAnisotropy = VK_TRUE;
@@ -547,6 +1005,31 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 			}
 		}
 	}
+	// Optional, for reporting the driver's view of our memory use when benchmarking
+	bool has_memory_budget = false;
+	for (const VkExtensionProperties& s : supported_device_extensions)
+	{
+		if (!vulkan.bench.enable_file || reqs.apiVersion < VK_API_VERSION_1_1) break;
+		if (strcmp(s.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) != 0) continue;
+		has_memory_budget = true;
+		if (vulkan.device_extensions.count(s.extensionName) > 0) break; // already enabled
+		enabledExtensions.push_back(s.extensionName);
+		vulkan.device_extensions.insert(s.extensionName);
+	}
+
+	// Optional, for translating GPU timestamps into our CPU time domain
+	const char* calibration_extension = nullptr;
+	for (const char* name : { VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME })
+	{
+		if (!gpu_timestamps || calibration_extension) break;
+		for (const VkExtensionProperties& s : supported_device_extensions) if (strcmp(s.extensionName, name) == 0) calibration_extension = name;
+	}
+	if (calibration_extension && vulkan.device_extensions.count(calibration_extension) == 0)
+	{
+		enabledExtensions.push_back(calibration_extension);
+		vulkan.device_extensions.insert(calibration_extension);
+	}
+
 	if (enabledExtensions.size() > 0) printf("Required Vulkan device extensions:\n");
 	for (auto str : enabledExtensions) printf("\t%s\n", str);
 	if (device_required.size() > 0)
@@ -576,6 +1059,22 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 	check(result);
 	test_set_name(vulkan, VK_OBJECT_TYPE_DEVICE, (uint64_t)vulkan.device, "Our device");
 
+	vkGetDeviceQueue(vulkan.device, 0, 0, &vulkan.graphics_queue);
+	vulkan.compute_queue = vulkan.graphics_queue;
+	vulkan.transfer_queue = vulkan.graphics_queue;
+	if (vulkan.compute_family != 0)
+	{
+		vkGetDeviceQueue(vulkan.device, vulkan.compute_family, 0, &vulkan.compute_queue);
+		test_set_name(vulkan, VK_OBJECT_TYPE_QUEUE, (uint64_t)vulkan.compute_queue, "Async compute queue");
+		vulkan.bench.run_info["compute_queue_family"] = vulkan.compute_family;
+	}
+	if (vulkan.transfer_family != 0)
+	{
+		vkGetDeviceQueue(vulkan.device, vulkan.transfer_family, 0, &vulkan.transfer_queue);
+		test_set_name(vulkan, VK_OBJECT_TYPE_QUEUE, (uint64_t)vulkan.transfer_queue, "Dedicated transfer queue");
+		vulkan.bench.run_info["transfer_queue_family"] = vulkan.transfer_family;
+	}
+
 	if (VK_VERSION_MAJOR(reqs.apiVersion) >= 1 && VK_VERSION_MINOR(reqs.apiVersion) >= 1)
 	{
 		VkPhysicalDeviceMemoryProperties2 mprops = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, nullptr };
@@ -586,6 +1085,7 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 	{
 		vkGetPhysicalDeviceMemoryProperties(vulkan.physical, &memory_properties);
 	}
+	memory_policy_init(vulkan);
 
 	if (has_debug_utils)
 	{
@@ -619,6 +1119,26 @@ vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vul
 		vulkan.vkCmdPushConstants2 = reinterpret_cast<PFN_vkCmdPushConstants2KHR>(vkGetDeviceProcAddr(vulkan.device, "vkCmdPushConstants2KHR"));
 	}
 
+	if (gpu_timestamps) gpu_timer_create(vulkan, families, calibration_extension);
+
+	if (reqs.suballocate)
+	{
+		vulkan.arena = std::make_shared<test_memory_arena>();
+		vulkan.arena->min_size = std::max<VkDeviceSize>(vulkan.arena->min_size, vulkan.device_properties.limits.nonCoherentAtomSize);
+		vulkan.bench.run_info["suballocate"] = true;
+	}
+	if (vulkan.sync->timeline) vulkan.bench.run_info["timeline"] = true;
+	if (image_format != IMAGE_FORMAT_PNG) vulkan.bench.run_info["image_format"] = image_format_names[image_format];
+
+	if (vulkan.bench.enable_file)
+	{
+		std::lock_guard<std::mutex> lock(memory_tracking_mutex);
+		memory_live.assign(memory_properties.memoryHeapCount, 0);
+		memory_peak.assign(memory_properties.memoryHeapCount, 0);
+		if (has_memory_budget) memory_budget_physical = vulkan.physical;
+		vulkan.bench.state->memory_hook = memory_tracking_hook;
+	}
+
 	return vulkan;
 }
 
@@ -689,7 +1209,7 @@ acceleration_structures::Buffer acceleration_structures::prepare_buffer(const vu
 	VkMemoryAllocateInfo memory_allocate_info{};
 	memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
 	memory_allocate_info.allocationSize = memory_requirements.size;
-	memory_allocate_info.memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, memory_properties);
+	memory_allocate_info.memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, memory_properties, vulkan.no_coherent);
 
 	VkMemoryAllocateFlagsInfoKHR allocation_flags_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR, nullptr };
 	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
@@ -699,13 +1219,14 @@ acceleration_structures::Buffer acceleration_structures::prepare_buffer(const vu
 	}
 
 	check(vkAllocateMemory(vulkan.device, &memory_allocate_info, nullptr, &buffer.memory));
+	test_track_memory_alloc(buffer.memory, memory_allocate_info.memoryTypeIndex, memory_allocate_info.allocationSize);
 
 	if (data)
 	{
 		void *mapped;
 		check(vkMapMemory(vulkan.device, buffer.memory, 0, size, 0, &mapped));
 		memcpy(mapped, data, size);
-		if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, buffer.memory, 0, size, true);
+		if (test_needs_flush(vulkan)) testFlushMemory(vulkan, buffer.memory, 0, size, true);
 		vkUnmapMemory(vulkan.device, buffer.memory);
 	}
 	check(vkBindBufferMemory(vulkan.device, buffer.handle, buffer.memory, 0));
@@ -738,8 +1259,61 @@ VkPipelineShaderStageCreateInfo acceleration_structures::prepare_shader_stage_cr
 	return shader_stage_create_info;
 }
 
+/// How much a strategy wants a memory type, or -1 if it cannot use it at all
+static int memory_strategy_score(test_memory_strategy strategy, VkMemoryPropertyFlags flags)
+{
+	if (flags & (VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT | VK_MEMORY_PROPERTY_PROTECTED_BIT)) return -1;
+	const bool device_local = flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	const bool host_visible = flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	const bool coherent = flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	const bool cached = flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	switch (strategy)
+	{
+	case TEST_MEMORY_DEVICE_LOCAL: return device_local * 4 + !host_visible * 2;
+	case TEST_MEMORY_STREAMING: return host_visible ? coherent * 4 + !cached * 2 + device_local : -1;
+	case TEST_MEMORY_READBACK: return host_visible ? cached * 4 + coherent * 2 + !device_local : -1;
+	default: break;
+	}
+	return -1;
+}
+
+static void memory_policy_init(vulkan_setup_t& vulkan)
+{
+	for (uint32_t flags = 0; flags < 512; flags++)
+	{
+		memory_type_masks[flags] = 0;
+		for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+		{
+			if ((memory_properties.memoryTypes[i].propertyFlags & flags) == flags) memory_type_masks[flags] |= 1 << i;
+		}
+	}
+	for (int strategy = 0; strategy < TEST_MEMORY_STRATEGIES; strategy++)
+	{
+		std::vector<uint32_t>& ranks = memory_type_ranks[strategy];
+		ranks.clear();
+		for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+		{
+			if (memory_strategy_score((test_memory_strategy)strategy, memory_properties.memoryTypes[i].propertyFlags) >= 0) ranks.push_back(i);
+		}
+		std::stable_sort(ranks.begin(), ranks.end(), [strategy](uint32_t a, uint32_t b) {
+			return memory_strategy_score((test_memory_strategy)strategy, memory_properties.memoryTypes[a].propertyFlags)
+			       > memory_strategy_score((test_memory_strategy)strategy, memory_properties.memoryTypes[b].propertyFlags); });
+		if (ranks.empty()) continue;
+		const uint32_t best = get_device_memory_type(UINT32_MAX, (test_memory_strategy)strategy, vulkan.no_coherent);
+		vulkan.bench.run_info[std::string("memory_type_") + memory_strategy_names[strategy]] = (int)best;
+		vulkan.bench.run_info[std::string("memory_flags_") + memory_strategy_names[strategy]] = (int)memory_properties.memoryTypes[best].propertyFlags;
+	}
+}
+
 uint32_t get_device_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties)
 {
+	if (properties < 512) // the common case, use the table
+	{
+		const uint32_t matching = type_filter & memory_type_masks[properties];
+		if (matching != 0) return __builtin_ctz(matching);
+		assert(false);
+		return 0xffff; // satisfy compiler
+	}
 	for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i)
 	{
 		if (type_filter & (1 << i) && (memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
@@ -751,6 +1325,38 @@ uint32_t get_device_memory_type(uint32_t type_filter, VkMemoryPropertyFlags prop
 	return 0xffff; // satisfy compiler
 }
 
+uint32_t get_device_memory_type(uint32_t type_filter, test_memory_strategy strategy, bool prefer_non_coherent)
+{
+	uint32_t found = UINT32_MAX;
+	for (uint32_t i : memory_type_ranks[strategy])
+	{
+		if (!(type_filter & (1 << i))) continue;
+		if (!prefer_non_coherent || !(memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) return i;
+		if (found == UINT32_MAX) found = i;
+	}
+	if (found == UINT32_MAX) ABORT("No memory type for the %s strategy among types 0x%x", memory_strategy_names[strategy], type_filter);
+	return found;
+}
+
+VkMemoryPropertyFlags get_device_memory_flags(uint32_t memory_type)
+{
+	return memory_properties.memoryTypes[memory_type].propertyFlags;
+}
+
+uint32_t get_device_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties, bool prefer_non_coherent)
+{
+	if (prefer_non_coherent && (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+	{
+		properties &= ~VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i)
+		{
+			const VkMemoryPropertyFlags flags = memory_properties.memoryTypes[i].propertyFlags;
+			if (type_filter & (1 << i) && (flags & properties) == properties && !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) return i;
+		}
+	}
+	return get_device_memory_type(type_filter, properties);
+}
+
 const char* errorString(const VkResult errorCode)
 {
 	switch (errorCode)
@@ -792,51 +1398,280 @@ const char* errorString(const VkResult errorCode)
 	}
 }
 
-/// Takes an RGBA/BGRA8888 or R32G32B32A32_SFLOAT image and saves it to disk as PNG
-void test_save_image(const vulkan_setup_t& vulkan, const char* filename, VkDeviceMemory memory, uint32_t offset,
-                     uint32_t width, uint32_t height, VkFormat format)
+/// Convert normalized floats to bytes, truncating like a plain cast would, but clamped
+static void convert_float_to_unorm8(const float* src, uint8_t* dst, uint32_t count)
 {
-	const uint32_t size = width * height * 4;
-	std::vector<unsigned char> image;
-	image.reserve(size);
+	uint32_t i = 0;
+#if defined(__SSE2__)
+	const __m128 scale = _mm_set1_ps(255.0f);
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v[4];
+		for (int k = 0; k < 4; k++) v[k] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i + k * 4), scale), zero), scale));
+		const __m128i lo = _mm_packs_epi32(v[0], v[1]);
+		const __m128i hi = _mm_packs_epi32(v[2], v[3]);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(__ARM_NEON)
+	const float32x4_t scale = vdupq_n_f32(255.0f);
+	for (; i + 16 <= count; i += 16)
+	{
+		uint16x4_t v[4];
+		for (int k = 0; k < 4; k++) v[k] = vqmovn_u32(vcvtq_u32_f32(vmulq_f32(vld1q_f32(src + i + k * 4), scale))); // saturating, negatives become zero
+		const uint16x8_t lo = vcombine_u16(v[0], v[1]);
+		const uint16x8_t hi = vcombine_u16(v[2], v[3]);
+		vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		const float v = 255.0f * src[i];
+		dst[i] = !(v > 0.0f) ? 0 : (v >= 255.0f) ? 255 : (uint8_t)v; // also maps NaN to zero
+	}
+}
 
-	if (format == VK_FORMAT_R32G32B32A32_SFLOAT)
+/// Swap the red and blue channels of BGRA8 pixels into RGBA8
+static void swizzle_bgra_to_rgba(const uint8_t* src, uint8_t* dst, uint32_t pixels)
+{
+	uint32_t i = 0;
+#if defined(__SSE2__)
+	const __m128i green_alpha = _mm_set1_epi32(0xff00ff00);
+	const __m128i low_byte = _mm_set1_epi32(0x000000ff);
+	for (; i + 4 <= pixels; i += 4)
+	{
+		const __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		const __m128i red = _mm_and_si128(_mm_srli_epi32(p, 16), low_byte);
+		const __m128i blue = _mm_slli_epi32(_mm_and_si128(p, low_byte), 16);
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_and_si128(p, green_alpha), _mm_or_si128(red, blue)));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= pixels; i += 16)
+	{
+		uint8x16x4_t p = vld4q_u8(src + i * 4);
+		const uint8x16_t blue = p.val[0];
+		p.val[0] = p.val[2];
+		p.val[2] = blue;
+		vst4q_u8(dst + i * 4, p);
+	}
+#endif
+	for (; i < pixels; i++)
+	{
+		dst[i * 4 + 0] = src[i * 4 + 2];
+		dst[i * 4 + 1] = src[i * 4 + 1];
+		dst[i * 4 + 2] = src[i * 4 + 0];
+		dst[i * 4 + 3] = src[i * 4 + 3];
+	}
+}
+
+/// Background PNG encoding of saved images, fed through a bounded queue so that a slow disk cannot eat all memory
+struct image_encoder
+{
+	struct job
+	{
+		std::string filename;
+		uint32_t width;
+		uint32_t height;
+		std::vector<uint8_t> pixels; // RGBA8
+		image_format_t format;
+	};
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable cond; // signalled on any change to queue, busy or done
+	std::deque<job> queue;
+	size_t capacity = 0;
+	uint32_t busy = 0; // jobs taken off the queue but not yet written
+	bool done = false;
+
+	~image_encoder() { stop(); }
+
+	void stop()
 	{
-		float* ptr = nullptr;
-		VkResult result = vkMapMemory(vulkan.device, memory, offset, size * sizeof(float), 0, (void**)&ptr);
-		check(result);
-		assert(ptr != nullptr);
-		for (uint32_t i = 0; i < size; i++)
 		{
-			image.push_back((unsigned char)(255.0f * ptr[i]));
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
 		}
-		vkUnmapMemory(vulkan.device, memory);
+		cond.notify_all();
+		for (std::thread& t : threads) t.join();
+		threads.clear();
 	}
-	else
+};
+static std::unique_ptr<image_encoder> encoder;
+
+/// Encode RGBA8 pixels as QOI, see the specification at https://qoiformat.org/qoi-specification.pdf
+static std::vector<uint8_t> qoi_encode(const uint8_t* pixels, uint32_t width, uint32_t height)
+{
+	const uint32_t count = width * height;
+	std::vector<uint8_t> out;
+	out.reserve(14 + count * 5 + 8); // worst case
+	auto put32 = [&out](uint32_t v) { for (int shift = 24; shift >= 0; shift -= 8) out.push_back(v >> shift); }; // big endian
+	out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+	put32(width);
+	put32(height);
+	out.push_back(4); // RGBA
+	out.push_back(0); // sRGB with linear alpha, which is only informative
+	uint8_t index[64][4] = {};
+	uint8_t prev[4] = { 0, 0, 0, 255 };
+	uint32_t run = 0;
+	for (uint32_t i = 0; i < count; i++)
 	{
-		uint8_t* ptr = nullptr;
-		VkResult result = vkMapMemory(vulkan.device, memory, offset, size * sizeof(uint8_t), 0, (void**)&ptr);
-		check(result);
-		assert(ptr != nullptr);
-		if (format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB)
+		const uint8_t* px = pixels + i * 4;
+		if (memcmp(px, prev, 4) == 0)
+		{
+			if (++run == 62 || i == count - 1) { out.push_back(0xc0 | (run - 1)); run = 0; } // QOI_OP_RUN
+			continue;
+		}
+		if (run > 0) { out.push_back(0xc0 | (run - 1)); run = 0; }
+		const uint32_t hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+		if (memcmp(index[hash], px, 4) == 0) out.push_back(hash); // QOI_OP_INDEX
+		else if (px[3] == prev[3])
 		{
-			for (uint32_t i = 0; i < size; i += 4)
+			memcpy(index[hash], px, 4);
+			const int8_t dr = px[0] - prev[0];
+			const int8_t dg = px[1] - prev[1];
+			const int8_t db = px[2] - prev[2];
+			const int8_t dr_dg = dr - dg;
+			const int8_t db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)); // QOI_OP_DIFF
+			else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) // QOI_OP_LUMA
 			{
-				image.push_back(ptr[i + 2]);
-				image.push_back(ptr[i + 1]);
-				image.push_back(ptr[i + 0]);
-				image.push_back(ptr[i + 3]);
+				out.push_back(0x80 | (dg + 32));
+				out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
 			}
+			else out.insert(out.end(), { 0xfe, px[0], px[1], px[2] }); // QOI_OP_RGB
 		}
 		else
 		{
-			image.insert(image.end(), ptr, ptr + size);
+			memcpy(index[hash], px, 4);
+			out.insert(out.end(), { 0xff, px[0], px[1], px[2], px[3] }); // QOI_OP_RGBA
 		}
-		vkUnmapMemory(vulkan.device, memory);
+		memcpy(prev, px, 4);
 	}
+	out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 }); // end marker
+	return out;
+}
 
-	int r = stbi_write_png(filename, width, height, 4, image.data(), 0);
-	assert(r != 0);
+static void image_encode(const image_encoder::job& j)
+{
+	bool ok = false;
+	if (j.format == IMAGE_FORMAT_PNG) ok = stbi_write_png(j.filename.c_str(), j.width, j.height, 4, j.pixels.data(), 0) != 0;
+	else
+	{
+		std::vector<uint8_t> qoi;
+		if (j.format == IMAGE_FORMAT_QOI) qoi = qoi_encode(j.pixels.data(), j.width, j.height);
+		const std::vector<uint8_t>& data = (j.format == IMAGE_FORMAT_QOI) ? qoi : j.pixels;
+		FILE* fp = fopen(j.filename.c_str(), "wb");
+		ok = fp && fwrite(data.data(), data.size(), 1, fp) == 1;
+		if (fp && fclose(fp) != 0) ok = false;
+	}
+	if (!ok) ELOG("Failed to write %s", j.filename.c_str());
+	assert(ok);
+}
+
+static void image_encoder_thread(image_encoder* e)
+{
+	set_thread_name("image-encoder", THREAD_HELPER);
+	std::unique_lock<std::mutex> lock(e->mutex);
+	while (true)
+	{
+		e->cond.wait(lock, [e] { return !e->queue.empty() || e->done; });
+		if (e->queue.empty()) break; // done, and all written
+		image_encoder::job j = std::move(e->queue.front());
+		e->queue.pop_front();
+		e->busy++;
+		lock.unlock();
+		e->cond.notify_all(); // room for more
+		image_encode(j);
+		lock.lock();
+		e->busy--;
+		e->cond.notify_all();
+	}
+}
+
+/// Hand the image over to the encoder threads, or encode it right away if there are none
+static void image_encoder_push(image_encoder::job&& j)
+{
+	if (image_threads <= 0) { image_encode(j); return; }
+	if (!encoder)
+	{
+		encoder = std::make_unique<image_encoder>();
+		encoder->capacity = image_threads * 2;
+		for (int i = 0; i < image_threads; i++) encoder->threads.emplace_back(image_encoder_thread, encoder.get());
+	}
+	std::unique_lock<std::mutex> lock(encoder->mutex);
+	encoder->cond.wait(lock, [] { return encoder->queue.size() < encoder->capacity; }); // wait for the encoders to catch up
+	encoder->queue.push_back(std::move(j));
+	lock.unlock();
+	encoder->cond.notify_all();
+}
+
+/// Wait for all saved images to be written to disk, and stop the encoder threads
+static void image_encoder_finish()
+{
+	if (!encoder) return;
+	encoder->stop();
+	encoder.reset();
+}
+
+/// Takes an RGBA/BGRA8888 or R32G32B32A32_SFLOAT image and saves it to disk as PNG
+void test_save_image(const vulkan_setup_t& vulkan, const char* filename, VkDeviceMemory memory, uint32_t offset,
+                     uint32_t width, uint32_t height, VkFormat format)
+{
+	const uint32_t size = width * height * 4;
+	const VkDeviceSize bytes = size * ((format == VK_FORMAT_R32G32B32A32_SFLOAT) ? sizeof(float) : sizeof(uint8_t));
+	image_encoder::job j = { filename, width, height, std::vector<uint8_t>(size), image_format };
+	if (image_format != IMAGE_FORMAT_PNG) // replace the extension
+	{
+		const size_t dot = j.filename.rfind('.');
+		if (dot != std::string::npos && j.filename.find('/', dot) == std::string::npos) j.filename.resize(dot);
+		if (image_format == IMAGE_FORMAT_QOI) j.filename += ".qoi";
+		else if (image_format == IMAGE_FORMAT_RAW) j.filename += "_" + std::to_string(width) + "x" + std::to_string(height) + ".rgba";
+	}
+
+	const VkDeviceSize atom = std::max<VkDeviceSize>(vulkan.device_properties.limits.nonCoherentAtomSize, 1);
+	char* mapped = arena_mapping(vulkan, memory);
+	const bool arena_block = (mapped != nullptr); // already mapped, as we cannot map it twice
+	const VkDeviceSize map_offset = arena_block ? 0 : offset - offset % atom; // arena blocks are mapped whole
+	if (!arena_block) check(vkMapMemory(vulkan.device, memory, map_offset, VK_WHOLE_SIZE, 0, (void**)&mapped));
+	assert(mapped != nullptr);
+	mapped += offset - map_offset;
+	const uint32_t host_visible = memory_type_masks[VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT];
+	const uint32_t host_coherent = memory_type_masks[VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT];
+	if (vulkan.no_coherent || host_visible != host_coherent) // may be non-coherent readback memory, and invalidating coherent memory is harmless
+	{
+		VkDeviceSize invalidate_offset = offset;
+		VkDeviceSize invalidate_size = bytes;
+		test_align_memory_range(atom, invalidate_offset, invalidate_size, VK_WHOLE_SIZE, map_offset);
+		VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
+		range.memory = memory;
+		range.offset = invalidate_offset;
+		range.size = invalidate_size;
+		VkResult result = vkInvalidateMappedMemoryRanges(vulkan.device, 1, &range);
+		check(result);
+	}
+	if (format == VK_FORMAT_R32G32B32A32_SFLOAT)
+	{
+		convert_float_to_unorm8((const float*)mapped, j.pixels.data(), size);
+	}
+	else if (format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB)
+	{
+		swizzle_bgra_to_rgba((const uint8_t*)mapped, j.pixels.data(), width * height);
+	}
+	else
+	{
+		memcpy(j.pixels.data(), mapped, size);
+	}
+	if (!arena_block) vkUnmapMemory(vulkan.device, memory);
+
+	if (image_format == IMAGE_FORMAT_HASH)
+	{
+		const uint64_t hash = hash64(j.pixels.data(), j.pixels.size());
+		if (!vulkan.bench.enable_file) printf("%s: %016llx\n", j.filename.c_str(), (unsigned long long)hash); // else in the results file
+		std::lock_guard<std::mutex> lock(vulkan.bench.state->mutex);
+		vulkan.bench.state->image_hashes.emplace_back(j.filename, hash);
+		return;
+	}
+	image_encoder_push(std::move(j));
 }
 
 std::vector<uint8_t> make_checker(uint32_t width, uint32_t height,
@@ -975,9 +1810,11 @@ uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vecto
 	{
 		VkMemoryRequirements memory_requirements;
 		vkGetBufferMemoryRequirements(vulkan.device, buffers.at(i), &memory_requirements);
-		const uint32_t memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		const uint32_t memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, TEST_MEMORY_STREAMING, vulkan.no_coherent);
 		const uint32_t align_mod = memory_requirements.size % memory_requirements.alignment;
-		const uint32_t new_aligned_size = (align_mod == 0) ? memory_requirements.size : (memory_requirements.size + memory_requirements.alignment - align_mod);
+		uint32_t new_aligned_size = (align_mod == 0) ? memory_requirements.size : (memory_requirements.size + memory_requirements.alignment - align_mod);
+		const uint32_t atom = vulkan.device_properties.limits.nonCoherentAtomSize;
+		if (vulkan.no_coherent && atom > 1 && new_aligned_size % atom != 0) new_aligned_size += atom - new_aligned_size % atom; // so that each buffer is mapped at a whole atom
 		assert(i == 0 || new_aligned_size == aligned_size);
 		aligned_size = new_aligned_size;
 
@@ -998,6 +1835,7 @@ uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vecto
 		VkResult result = vkAllocateMemory(vulkan.device, &pAllocateMemInfo, nullptr, &memory.back());
 		assert(result == VK_SUCCESS);
 		assert(memory.back() != VK_NULL_HANDLE);
+		test_track_memory_alloc(memory.back(), memoryTypeIndex, pAllocateMemInfo.allocationSize);
 	}
 	// Bind
 	if (vulkan.apiVersion < VK_API_VERSION_1_1)
@@ -1032,6 +1870,7 @@ uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vecto
 	for (unsigned i = 0; i < buffers.size(); i++)
 	{
 		const VkDeviceSize offset = dedicated ? 0 : i * aligned_size;
+		const VkDeviceSize map_offset = offset - offset % std::max<VkDeviceSize>(vulkan.device_properties.limits.nonCoherentAtomSize, 1); // so flushes can start on a whole atom
 		uint8_t* data = nullptr;
 		VkDeviceMemory mem = memory.at(dedicated ? i : 0);
 		if (vulkan.apiVersion >= VK_API_VERSION_1_4)
@@ -1039,28 +1878,20 @@ uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vecto
 			VkMemoryMapInfo map_info = { VK_STRUCTURE_TYPE_MEMORY_MAP_INFO, nullptr };
 			map_info.flags = 0;
 			map_info.memory = mem;
-			map_info.offset = offset;
-			map_info.size = aligned_size;
+			map_info.offset = map_offset;
+			map_info.size = aligned_size + offset - map_offset;
 			VkResult result = vkMapMemory2(vulkan.device, &map_info, (void**)&data);
 			check(result);
 		}
 		else
 		{
-			VkResult result = vkMapMemory(vulkan.device, mem, offset, aligned_size, 0, (void**)&data);
+			VkResult result = vkMapMemory(vulkan.device, mem, map_offset, aligned_size + offset - map_offset, 0, (void**)&data);
 			assert(result == VK_SUCCESS);
 		}
+		data += offset - map_offset;
 		memset(data, pattern ? i : 0, aligned_size);
 		// Explicit notification
-		if (vulkan.has_explicit_host_updates)
-		{
-			VkFlushRangesFlagsARM frf = { VK_STRUCTURE_TYPE_FLUSH_RANGES_FLAGS_ARM, nullptr };
-			frf.flags = VK_FLUSH_OPERATION_INFORMATIVE_BIT_ARM;
-			VkMappedMemoryRange mmr = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, &frf };
-			mmr.memory = mem;
-			mmr.offset = offset;
-			mmr.size = VK_WHOLE_SIZE;
-			vkFlushMappedMemoryRanges(vulkan.device, 1, &mmr);
-		}
+		if (test_needs_flush(vulkan)) testFlushMemory(vulkan, mem, offset, aligned_size, true, nullptr, map_offset);
 		if (vulkan.apiVersion >= VK_API_VERSION_1_4)
 		{
 			VkMemoryUnmapInfo unmap_info = { VK_STRUCTURE_TYPE_MEMORY_UNMAP_INFO, nullptr };
@@ -1085,11 +1916,194 @@ uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vecto
 	return aligned_size;
 }
 
-void testFlushMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, bool extra, VkMarkedOffsetsARM* markings)
+uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vector<VkBuffer>& buffers, std::vector<test_suballocation>& allocations, bool deviceaddress, bool pattern, const char* name)
+{
+	uint32_t aligned_size = 0;
+	for (unsigned i = 0; i < buffers.size(); i++)
+	{
+		VkMemoryRequirements memory_requirements;
+		vkGetBufferMemoryRequirements(vulkan.device, buffers.at(i), &memory_requirements);
+		const uint32_t align_mod = memory_requirements.size % memory_requirements.alignment;
+		const uint32_t new_aligned_size = (align_mod == 0) ? memory_requirements.size : (memory_requirements.size + memory_requirements.alignment - align_mod);
+		assert(i == 0 || new_aligned_size == aligned_size);
+		aligned_size = new_aligned_size;
+		const uint32_t memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, TEST_MEMORY_STREAMING, vulkan.no_coherent);
+		allocations.push_back(test_arena_allocate(vulkan, memory_requirements, memoryTypeIndex, true, deviceaddress));
+		const test_suballocation& a = allocations.back();
+		VkResult result = vkBindBufferMemory(vulkan.device, buffers.at(i), a.memory, a.offset);
+		check(result);
+		memset(a.mapped, pattern ? i : 0, memory_requirements.size);
+		if (test_needs_flush(vulkan)) testFlushMemory(vulkan, a.memory, a.offset, memory_requirements.size, true);
+		if (name)
+		{
+			std::string bufname = std::string(name) + "_" + std::to_string(i) + "_offset=" + std::to_string(a.offset);
+			test_set_name(vulkan, VK_OBJECT_TYPE_BUFFER, (uint64_t)buffers.at(i), bufname.c_str());
+		}
+	}
+	return aligned_size;
+}
+
+static uint32_t arena_order(VkDeviceSize min_size, VkDeviceSize size)
+{
+	uint32_t order = 0;
+	while ((min_size << order) < size) order++;
+	return order;
+}
+
+static void arena_block_create(const vulkan_setup_t& vulkan, test_memory_arena& arena, const test_memory_arena::pool& p, test_memory_arena::block& b, VkDeviceSize size)
+{
+	VkMemoryAllocateFlagsInfo flaginfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO, nullptr, VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, 0 };
+	VkMemoryAllocateInfo info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, p.device_address ? &flaginfo : nullptr };
+	info.allocationSize = size;
+	info.memoryTypeIndex = p.memory_type;
+	VkResult result = vkAllocateMemory(vulkan.device, &info, nullptr, &b.memory);
+	if (result != VK_SUCCESS) ABORT("Failed to allocate %" PRIu64 " bytes for the device memory arena: %s", (uint64_t)size, errorString(result));
+	test_track_memory_alloc(b.memory, p.memory_type, size);
+	if (memory_properties.memoryTypes[p.memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		result = vkMapMemory(vulkan.device, b.memory, 0, VK_WHOLE_SIZE, 0, (void**)&b.mapped);
+		check(result);
+	}
+	arena.block_count++;
+}
+
+static void arena_block_destroy(const vulkan_setup_t& vulkan, test_memory_arena::block& b)
+{
+	if (b.mapped) vkUnmapMemory(vulkan.device, b.memory);
+	testFreeMemory(vulkan, b.memory);
+	b.memory = VK_NULL_HANDLE;
+	b.mapped = nullptr;
+}
+
+test_suballocation test_arena_allocate(const vulkan_setup_t& vulkan, const VkMemoryRequirements& req, uint32_t memory_type, bool linear, bool device_address)
+{
+	assert(vulkan.arena);
+	assert(req.memoryTypeBits & (1 << memory_type));
+	test_memory_arena& arena = *vulkan.arena;
+	test_suballocation a;
+	a.pool = memory_type | (linear ? 0 : 0x100) | (device_address ? 0x200 : 0);
+	a.size = req.size;
+
+	std::lock_guard<std::mutex> lock(arena.mutex);
+	test_memory_arena::pool& p = arena.pools[a.pool];
+	if (p.block_size == 0) // first use
+	{
+		const VkDeviceSize heap_size = memory_properties.memoryHeaps[memory_properties.memoryTypes[memory_type].heapIndex].size;
+		p.memory_type = memory_type;
+		p.device_address = device_address;
+		p.block_size = arena.block_size;
+		while (p.block_size > arena.min_size && p.block_size > heap_size / 8) p.block_size /= 2;
+		p.orders = arena_order(arena.min_size, p.block_size) + 1;
+	}
+	a.order = arena_order(arena.min_size, std::max(req.size, req.alignment)); // pieces are aligned to their own size
+	if (a.order >= p.orders) a.order = UINT32_MAX; // too big, so give it a block of its own
+
+	test_memory_arena::block* b = nullptr;
+	uint32_t order = a.order; // of the free piece we found
+	for (unsigned i = 0; i < p.blocks.size() && !b && a.order != UINT32_MAX; i++)
+	{
+		if (p.blocks[i].free.empty()) continue; // a dedicated block
+		for (order = a.order; order < p.orders && p.blocks[i].free[order].empty(); order++) {}
+		if (order < p.orders) b = &p.blocks[i];
+	}
+	if (!b)
+	{
+		p.blocks.emplace_back();
+		b = &p.blocks.back();
+		arena_block_create(vulkan, arena, p, *b, (a.order == UINT32_MAX) ? req.size : p.block_size);
+		if (a.order != UINT32_MAX)
+		{
+			b->free.resize(p.orders);
+			b->free.back().insert(0);
+			order = p.orders - 1;
+		}
+	}
+	if (a.order != UINT32_MAX)
+	{
+		a.offset = *b->free[order].begin(); // lowest first, to keep blocks compact
+		b->free[order].erase(b->free[order].begin());
+		while (order > a.order) // split, keeping the lower half and freeing the upper
+		{
+			order--;
+			b->free[order].insert(a.offset + (arena.min_size << order));
+		}
+	}
+	b->live++;
+	arena.allocations++;
+	a.memory = b->memory;
+	if (b->mapped) a.mapped = b->mapped + a.offset;
+	return a;
+}
+
+void test_arena_free(const vulkan_setup_t& vulkan, test_suballocation& a)
+{
+	if (a.memory == VK_NULL_HANDLE) return;
+	assert(vulkan.arena);
+	test_memory_arena& arena = *vulkan.arena;
+	std::lock_guard<std::mutex> lock(arena.mutex);
+	test_memory_arena::pool& p = arena.pools.at(a.pool);
+	auto it = std::find_if(p.blocks.begin(), p.blocks.end(), [&](const test_memory_arena::block& b) { return b.memory == a.memory; });
+	assert(it != p.blocks.end());
+	if (a.order != UINT32_MAX)
+	{
+		VkDeviceSize offset = a.offset;
+		uint32_t order = a.order;
+		for (; order + 1 < p.orders; order++) // merge with the buddy for as long as it is free
+		{
+			const VkDeviceSize buddy = offset ^ (arena.min_size << order);
+			if (it->free[order].erase(buddy) == 0) break;
+			offset = std::min(offset, buddy);
+		}
+		it->free[order].insert(offset);
+	}
+	it->live--;
+	// Dedicated blocks go right away, but keep one empty shared block per pool around to avoid churn
+	const bool spare = std::any_of(p.blocks.begin(), p.blocks.end(), [&](const test_memory_arena::block& b) { return b.memory != a.memory && b.live == 0 && !b.free.empty(); });
+	if (it->live == 0 && (a.order == UINT32_MAX || spare))
+	{
+		arena_block_destroy(vulkan, *it);
+		p.blocks.erase(it);
+	}
+	a = test_suballocation();
+}
+
+/// Host pointer to the start of the given memory if it is a mapped block of the device memory arena, else null
+static char* arena_mapping(const vulkan_setup_t& vulkan, VkDeviceMemory memory)
+{
+	if (!vulkan.arena) return nullptr;
+	std::lock_guard<std::mutex> lock(vulkan.arena->mutex);
+	for (const auto& pair : vulkan.arena->pools)
+	{
+		for (const test_memory_arena::block& b : pair.second.blocks) if (b.memory == memory) return b.mapped;
+	}
+	return nullptr;
+}
+
+static void test_arena_destroy(vulkan_setup_t& vulkan)
+{
+	if (!vulkan.arena) return;
+	uint64_t leaked = 0;
+	for (auto& pair : vulkan.arena->pools)
+	{
+		for (test_memory_arena::block& b : pair.second.blocks)
+		{
+			leaked += b.live;
+			arena_block_destroy(vulkan, b);
+		}
+	}
+	if (leaked) ELOG("%" PRIu64 " device memory arena sub-allocations were never freed", leaked);
+	DLOG("Device memory arena handed out %" PRIu64 " sub-allocations from %" PRIu64 " blocks", vulkan.arena->allocations, vulkan.arena->block_count);
+	vulkan.arena = nullptr;
+}
+
+void testFlushMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, bool extra, VkMarkedOffsetsARM* markings, VkDeviceSize map_offset)
 {
 	VkFlushRangesFlagsARM frf = { VK_STRUCTURE_TYPE_FLUSH_RANGES_FLAGS_ARM, nullptr };
 	frf.flags = VK_FLUSH_OPERATION_INFORMATIVE_BIT_ARM;
 	VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
+	if (vulkan.no_coherent) extra = false; // then the flush is needed
+	// ranges must cover whole atoms even for informative flushes, and widening them is harmless on coherent memory
+	test_align_memory_range(vulkan.device_properties.limits.nonCoherentAtomSize, offset, size, VK_WHOLE_SIZE, map_offset);
 	range.memory = memory;
 	range.size = size;
 	range.offset = offset;
@@ -1099,76 +2113,235 @@ void testFlushMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDevi
 	check(result);
 }
 
-void testCopyBuffer(const vulkan_setup_t& vulkan, VkQueue queue, VkBuffer target, VkBuffer origin, VkDeviceSize size)
+void testInvalidateMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, VkDeviceSize map_offset)
 {
-	VkCommandPool command_pool;
-	VkCommandBuffer command_buffer;
-	VkFence fence;
-
-	VkCommandPoolCreateInfo command_pool_create_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
-	command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	VkResult result = vkCreateCommandPool(vulkan.device, &command_pool_create_info, NULL, &command_pool);
+	if (!vulkan.no_coherent) return;
+	test_align_memory_range(vulkan.device_properties.limits.nonCoherentAtomSize, offset, size, VK_WHOLE_SIZE, map_offset);
+	VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
+	range.memory = memory;
+	range.size = size;
+	range.offset = offset;
+	VkResult result = vkInvalidateMappedMemoryRanges(vulkan.device, 1, &range);
 	check(result);
+}
 
-	VkCommandBufferAllocateInfo command_buffer_allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
-	command_buffer_allocate_info.commandPool = command_pool;
-	command_buffer_allocate_info.commandBufferCount = 1;
-	result = vkAllocateCommandBuffers(vulkan.device, &command_buffer_allocate_info, &command_buffer);
-	check(result);
+void test_align_memory_range(VkDeviceSize atom, VkDeviceSize& offset, VkDeviceSize& size, VkDeviceSize allocation_size, VkDeviceSize map_offset)
+{
+	if (atom <= 1) return;
+	assert(map_offset % atom == 0);
+	const VkDeviceSize start = std::max(offset - offset % atom, map_offset);
+	if (size != VK_WHOLE_SIZE)
+	{
+		const VkDeviceSize end = offset + size;
+		const VkDeviceSize padded = (end % atom == 0) ? end : end + atom - end % atom;
+		if (padded == end || (allocation_size != VK_WHOLE_SIZE && padded <= allocation_size)) size = padded - start;
+		else if (end == allocation_size) size = end - start;
+		else size = VK_WHOLE_SIZE;
+	}
+	offset = start;
+}
 
-	VkFenceCreateInfo fence_create_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-	result = vkCreateFence(vulkan.device, &fence_create_info, NULL, &fence);
-	check(result);
+/// Command buffer to record one-shot work for the given queue into, begun and ready
+static VkCommandBuffer submit_begin(const vulkan_setup_t& vulkan, VkQueue queue)
+{
+	test_submit_context& c = (*vulkan.submit_contexts)[queue];
+	if (c.pool == VK_NULL_HANDLE) // first use of this queue
+	{
+		VkCommandPoolCreateInfo command_pool_create_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
+		command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		command_pool_create_info.queueFamilyIndex = test_queue_family(vulkan, queue);
+		VkResult result = vkCreateCommandPool(vulkan.device, &command_pool_create_info, NULL, &c.pool);
+		check(result);
 
-	VkCommandBufferBeginInfo command_buffer_begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
-	command_buffer_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-	result = vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info);
-	check(result);
+		VkCommandBufferAllocateInfo command_buffer_allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
+		command_buffer_allocate_info.commandPool = c.pool;
+		command_buffer_allocate_info.commandBufferCount = 1;
+		result = vkAllocateCommandBuffers(vulkan.device, &command_buffer_allocate_info, &c.cmdbuf);
+		check(result);
 
-	testCmdCopyBuffer(vulkan, command_buffer, { origin }, { target }, size);
+		VkFenceCreateInfo fence_create_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+		result = vkCreateFence(vulkan.device, &fence_create_info, NULL, &c.fence);
+		check(result);
+	}
+	if (!c.recording)
+	{
+		VkCommandBufferBeginInfo command_buffer_begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
+		command_buffer_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		VkResult result = vkBeginCommandBuffer(c.cmdbuf, &command_buffer_begin_info);
+		check(result);
+		c.recording = true;
+	}
+	else if (c.batching) // keep batched work in the same order as if each had been waited for
+	{
+		VkMemoryBarrier memory_barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr };
+		memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		memory_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(c.cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memory_barrier, 0, NULL, 0, NULL);
+	}
+	return c.cmdbuf;
+}
 
-	result = vkEndCommandBuffer(command_buffer);
+/// Submit what was recorded and wait for it, unless we are batching
+static void submit_end(const vulkan_setup_t& vulkan, VkQueue queue)
+{
+	test_submit_context& c = vulkan.submit_contexts->at(queue);
+	if (c.batching || !c.recording) return;
+
+	VkResult result = vkEndCommandBuffer(c.cmdbuf);
 	check(result);
+	c.recording = false;
 
 	VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
 	submit_info.commandBufferCount = 1;
-	submit_info.pCommandBuffers = &command_buffer;
-	result = vkQueueSubmit(queue, 1, &submit_info, fence);
+	submit_info.pCommandBuffers = &c.cmdbuf;
+	result = vkQueueSubmit(queue, 1, &submit_info, c.fence);
 	check(result);
 
-	result = vkWaitForFences(vulkan.device, 1, &fence, VK_TRUE, UINT64_MAX);
+	result = vkWaitForFences(vulkan.device, 1, &c.fence, VK_TRUE, UINT64_MAX);
 	check(result);
 
-	vkDestroyFence(vulkan.device, fence, nullptr);
-	vkFreeCommandBuffers(vulkan.device, command_pool, 1, &command_buffer);
-	vkDestroyCommandPool(vulkan.device, command_pool, nullptr);
+	// Recycle for next time
+	result = vkResetFences(vulkan.device, 1, &c.fence);
+	check(result);
+	result = vkResetCommandPool(vulkan.device, c.pool, 0);
+	check(result);
 }
 
-void testQueueBuffer(const vulkan_setup_t& vulkan, VkQueue queue, const std::vector<VkBuffer>& buffers)
+static void submit_contexts_destroy(vulkan_setup_t& vulkan)
 {
-	VkCommandPool command_pool;
-	VkCommandBuffer command_buffer;
-	VkFence fence;
+	for (auto& pair : *vulkan.submit_contexts)
+	{
+		test_submit_context& c = pair.second;
+		if (c.recording) ELOG("Batch of one-shot submits was never ended");
+		if (c.pool == VK_NULL_HANDLE) continue; // never used
+		vkDestroyFence(vulkan.device, c.fence, nullptr);
+		vkFreeCommandBuffers(vulkan.device, c.pool, 1, &c.cmdbuf);
+		vkDestroyCommandPool(vulkan.device, c.pool, nullptr);
+	}
+	vulkan.submit_contexts->clear();
+}
 
-	VkCommandPoolCreateInfo command_pool_create_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
-	command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	VkResult result = vkCreateCommandPool(vulkan.device, &command_pool_create_info, NULL, &command_pool);
+void test_batch_begin(const vulkan_setup_t& vulkan, VkQueue queue)
+{
+	test_submit_context& c = (*vulkan.submit_contexts)[queue];
+	assert(!c.batching);
+	c.batching = true;
+}
+
+void test_batch_end(const vulkan_setup_t& vulkan, VkQueue queue)
+{
+	test_submit_context& c = vulkan.submit_contexts->at(queue);
+	assert(c.batching);
+	c.batching = false;
+	submit_end(vulkan, queue);
+}
+
+uint32_t test_queue_family(const vulkan_setup_t& vulkan, VkQueue queue)
+{
+	if (queue == vulkan.graphics_queue) return vulkan.graphics_family;
+	if (queue == vulkan.compute_queue) return vulkan.compute_family;
+	if (queue == vulkan.transfer_queue) return vulkan.transfer_family;
+	return 0;
+}
+
+VkFence test_fence_acquire(const vulkan_setup_t& vulkan)
+{
+	VkFence fence = VK_NULL_HANDLE;
+	if (!vulkan.sync->fences.empty())
+	{
+		fence = vulkan.sync->fences.back();
+		vulkan.sync->fences.pop_back();
+		return fence;
+	}
+	VkFenceCreateInfo fence_create_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr };
+	VkResult result = vkCreateFence(vulkan.device, &fence_create_info, nullptr, &fence);
+	check(result);
+	return fence;
+}
+
+void test_fence_release(const vulkan_setup_t& vulkan, VkFence fence)
+{
+	VkResult result = vkResetFences(vulkan.device, 1, &fence);
 	check(result);
+	vulkan.sync->fences.push_back(fence);
+}
 
-	VkCommandBufferAllocateInfo command_buffer_allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
-	command_buffer_allocate_info.commandPool = command_pool;
-	command_buffer_allocate_info.commandBufferCount = 1;
-	result = vkAllocateCommandBuffers(vulkan.device, &command_buffer_allocate_info, &command_buffer);
+VkSemaphore test_semaphore_acquire(const vulkan_setup_t& vulkan)
+{
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+	if (!vulkan.sync->semaphores.empty())
+	{
+		semaphore = vulkan.sync->semaphores.back();
+		vulkan.sync->semaphores.pop_back();
+		return semaphore;
+	}
+	VkSemaphoreCreateInfo semaphore_create_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr };
+	VkResult result = vkCreateSemaphore(vulkan.device, &semaphore_create_info, nullptr, &semaphore);
 	check(result);
+	return semaphore;
+}
+
+void test_semaphore_release(const vulkan_setup_t& vulkan, VkSemaphore semaphore)
+{
+	vulkan.sync->semaphores.push_back(semaphore);
+}
+
+VkSemaphore test_timeline_next(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t& value)
+{
+	if (!vulkan.sync->timeline) return VK_NULL_HANDLE;
+	std::pair<VkSemaphore, uint64_t>& timeline = vulkan.sync->timelines[queue];
+	if (timeline.first == VK_NULL_HANDLE) // first use of this queue
+	{
+		VkSemaphoreTypeCreateInfo type_create_info = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO, nullptr };
+		type_create_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		type_create_info.initialValue = 0;
+		VkSemaphoreCreateInfo semaphore_create_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &type_create_info };
+		VkResult result = vkCreateSemaphore(vulkan.device, &semaphore_create_info, nullptr, &timeline.first);
+		check(result);
+		test_set_name(vulkan, VK_OBJECT_TYPE_SEMAPHORE, (uint64_t)timeline.first, "Queue timeline semaphore");
+	}
+	value = ++timeline.second;
+	return timeline.first;
+}
 
-	VkFenceCreateInfo fence_create_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-	result = vkCreateFence(vulkan.device, &fence_create_info, NULL, &fence);
+void test_timeline_wait(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t value)
+{
+	VkSemaphoreWaitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO, nullptr };
+	wait_info.semaphoreCount = 1;
+	wait_info.pSemaphores = &vulkan.sync->timelines.at(queue).first;
+	wait_info.pValues = &value;
+	VkResult result = vkWaitSemaphores(vulkan.device, &wait_info, UINT64_MAX);
 	check(result);
+}
 
-	VkCommandBufferBeginInfo command_buffer_begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
-	command_buffer_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-	result = vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info);
+bool test_timeline_reached(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t value)
+{
+	uint64_t current = 0;
+	VkResult result = vkGetSemaphoreCounterValue(vulkan.device, vulkan.sync->timelines.at(queue).first, &current);
 	check(result);
+	return current >= value;
+}
+
+static void sync_pool_destroy(vulkan_setup_t& vulkan)
+{
+	for (VkFence fence : vulkan.sync->fences) vkDestroyFence(vulkan.device, fence, nullptr);
+	for (VkSemaphore semaphore : vulkan.sync->semaphores) vkDestroySemaphore(vulkan.device, semaphore, nullptr);
+	for (auto& pair : vulkan.sync->timelines) vkDestroySemaphore(vulkan.device, pair.second.first, nullptr);
+	vulkan.sync->fences.clear();
+	vulkan.sync->semaphores.clear();
+	vulkan.sync->timelines.clear();
+}
+
+void testCopyBuffer(const vulkan_setup_t& vulkan, VkQueue queue, VkBuffer target, VkBuffer origin, VkDeviceSize size)
+{
+	VkCommandBuffer command_buffer = submit_begin(vulkan, queue);
+	testCmdCopyBuffer(vulkan, command_buffer, { origin }, { target }, size);
+	submit_end(vulkan, queue);
+}
+
+void testQueueBuffer(const vulkan_setup_t& vulkan, VkQueue queue, const std::vector<VkBuffer>& buffers)
+{
+	VkCommandBuffer command_buffer = submit_begin(vulkan, queue);
 
 	for (VkBuffer buffer : buffers)
 	{
@@ -1184,19 +2357,5 @@ void testQueueBuffer(const vulkan_setup_t& vulkan, VkQueue queue, const std::vec
 		vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memory_barrier, 1, &buffer_barrier, 0, NULL);
 	}
 
-	result = vkEndCommandBuffer(command_buffer);
-	check(result);
-
-	VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
-	submit_info.commandBufferCount = 1;
-	submit_info.pCommandBuffers = &command_buffer;
-	result = vkQueueSubmit(queue, 1, &submit_info, fence);
-	check(result);
-
-	result = vkWaitForFences(vulkan.device, 1, &fence, VK_TRUE, UINT64_MAX);
-	check(result);
-
-	vkDestroyFence(vulkan.device, fence, nullptr);
-	vkFreeCommandBuffers(vulkan.device, command_pool, 1, &command_buffer);
-	vkDestroyCommandPool(vulkan.device, command_pool, nullptr);
+	submit_end(vulkan, queue);
 }
@@ -10,6 +10,12 @@
 #include <array>
 #include <unordered_set>
 #include <unordered_map>
+#include <memory>
+#include <functional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
 
 #ifdef NDEBUG
 #ifdef __clang__
@@ -49,6 +55,15 @@ struct vulkan_req_t;
 typedef void (*TOOLSTEST_CALLBACK_USAGE)();
 typedef bool (*TOOLSTEST_CALLBACK_CMDOPT)(int& i, int argc, char **argv, vulkan_req_t& reqs);
 
+/// A named variant of a test, that can be activated through the scenes list of the benchmarking enable file or
+/// with -sc/--scene, so that several variants run back to back in one process.
+struct test_scene
+{
+	std::string name;
+	std::string description;
+	std::vector<std::string> args; // test specific command line options that select this variant
+};
+
 struct vulkan_req_t // Vulkan context requirements
 {
 	VkPhysicalDeviceVulkan14Features reqfeat14 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_4_FEATURES, nullptr };
@@ -59,7 +74,9 @@ struct vulkan_req_t // Vulkan context requirements
 	uint32_t apiVersion = VK_API_VERSION_1_1;
 	uint32_t minApiVersion = VK_API_VERSION_1_0; // the minimum required for the test
 	uint32_t maxApiVersion = VK_API_VERSION_1_4; // the maximum allowed for the test
-	uint32_t queues = 1;
+	uint32_t queues = 1; // from queue family zero, which must support graphics and compute
+	bool async_compute = false; // also create a queue from a compute family without graphics, if there is one
+	bool dedicated_transfer = false; // also create a queue from a transfer family without graphics or compute, if there is one
 	std::vector<std::string> instance_extensions;
 	std::vector<std::string> device_extensions;
 	bool samplerAnisotropy = false;
@@ -69,7 +86,110 @@ struct vulkan_req_t // Vulkan context requirements
 	VkInstance instance = VK_NULL_HANDLE; // reuse existing instance if non-null
 	VkBaseInStructure* extension_features = nullptr;
 	uint32_t fence_delay = 0;
+	bool suballocate = false; // create a device memory arena, which the common helpers then sub-allocate from
+	bool timeline = false; // enable timeline semaphores if supported, and give each queue one for test_timeline_next()
 	std::unordered_map<std::string, std::variant<int, bool, std::string>> options;
+	std::vector<test_scene> scenes; // registry of variants that can be run as scenes, options must be handled by cmdopt
+	std::vector<unsigned> active_scenes; // indices into the above of the scenes to run, in order
+};
+
+/// A piece of a block of device memory handed out by test_arena_allocate()
+struct test_suballocation
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0; // as asked for, the piece reserved may be larger
+	char* mapped = nullptr; // host pointer to the start of the piece, if the memory is host visible
+	uint32_t pool = 0; // which pool it came from
+	uint32_t order = 0; // buddy order of the piece, or UINT32_MAX if it got a block of its own
+};
+
+/// Buddy allocator over large device memory blocks, for sub-allocating resources the way real engines do rather than
+/// making one allocation per resource. Blocks are kept persistently mapped if host visible. Thread safe.
+struct test_memory_arena
+{
+	struct block
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		char* mapped = nullptr;
+		std::vector<std::set<VkDeviceSize>> free; // free offsets per buddy order, empty for dedicated blocks
+		uint32_t live = 0; // sub-allocations handed out
+	};
+	/// Linear and non-linear resources get separate pools so that they never share a bufferImageGranularity page
+	struct pool
+	{
+		uint32_t memory_type = 0;
+		bool device_address = false;
+		VkDeviceSize block_size = 0;
+		uint32_t orders = 0; // number of buddy orders, the largest being the whole block
+		std::vector<block> blocks;
+	};
+	std::mutex mutex;
+	std::map<uint32_t, pool> pools; // keyed by memory type, tiling and device address flag
+	VkDeviceSize block_size = 64 * 1024 * 1024; // largest block size, smaller for small heaps
+	VkDeviceSize min_size = 256; // smallest piece handed out, the size of buddy order zero
+	uint64_t allocations = 0; // totals for the run information
+	uint64_t block_count = 0;
+};
+
+/// Recycled command buffer and fence for the one-shot submits of testCopyBuffer() and testQueueBuffer() on one queue
+struct test_submit_context
+{
+	VkCommandPool pool = VK_NULL_HANDLE;
+	VkCommandBuffer cmdbuf = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	bool batching = false; // between test_batch_begin() and test_batch_end()
+	bool recording = false; // cmdbuf has begun
+};
+
+/// Named memory type selection strategies, for get_device_memory_type()
+enum test_memory_strategy
+{
+	TEST_MEMORY_DEVICE_LOCAL, // only used by the GPU, filled through a staging buffer
+	TEST_MEMORY_STREAMING, // written by the host and read by the GPU; coherent and uncached, device local if possible
+	TEST_MEMORY_READBACK, // written by the GPU and read by the host; host cached if possible, which may need invalidates
+	TEST_MEMORY_STRATEGIES
+};
+
+/// Recycled fences and binary semaphores, and a timeline semaphore per queue if enabled with -tl/--timeline. Not thread safe.
+struct test_sync_pool
+{
+	std::vector<VkFence> fences; // unsignaled
+	std::vector<VkSemaphore> semaphores; // unsignaled with no pending operations
+	std::unordered_map<VkQueue, std::pair<VkSemaphore, uint64_t>> timelines; // per queue, with the last value handed out
+	bool timeline = false;
+};
+
+/// GPU timestamp queries bracketing benchmarked submits. Thread safe; each thread collects only the slots it submitted.
+struct gpu_timer_t
+{
+	/// Timer command buffers for one queue family, created on first use
+	struct family_t
+	{
+		VkCommandPool command_pool = VK_NULL_HANDLE;
+		std::vector<VkCommandBuffer> begin; // per slot, pre-recorded to reset its queries and write a top of pipe timestamp
+		std::vector<VkCommandBuffer> end; // per slot, pre-recorded to write a bottom of pipe timestamp
+	};
+	/// GPU time span of the slots collected for a thread's current iteration
+	struct span_t
+	{
+		uint64_t start = UINT64_MAX;
+		uint64_t end = 0;
+	};
+	std::mutex mutex; // guards all members below once created
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueryPool pool = VK_NULL_HANDLE;
+	std::vector<uint32_t> valid_bits; // per queue family, zero if we cannot time work on it
+	std::unordered_map<uint32_t, family_t> families;
+	std::vector<std::thread::id> owners; // per slot, thread that submitted it, or default constructed if free
+	std::vector<uint64_t> submitted; // per slot, CPU time of submission
+	std::vector<uint64_t> masks; // per slot, valid timestamp bits of the queue family it went to
+	uint32_t next = 0; // where to start looking for a free slot
+	std::unordered_map<std::thread::id, span_t> spans; // per thread
+	double period = 1.0; // nanoseconds per tick
+	bool calibrated = false; // if true, results are translated into the CLOCK_MONOTONIC domain used by gettime()
+	uint64_t gpu_base = 0; // GPU ticks and CPU nanoseconds at the calibration point
+	uint64_t cpu_base = 0;
 };
 
 struct vulkan_setup_t
@@ -99,11 +219,23 @@ struct vulkan_setup_t
 	VkPhysicalDeviceProperties device_properties = {};
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR device_ray_tracing_pipeline_properties = {};
 	benchmarking bench;
+	std::shared_ptr<gpu_timer_t> gpu_timer; // null unless GPU timestamps are enabled
+	std::shared_ptr<test_memory_arena> arena; // null unless sub-allocation was asked for
+	std::shared_ptr<std::unordered_map<VkQueue, test_submit_context>> submit_contexts = std::make_shared<std::unordered_map<VkQueue, test_submit_context>>();
+	std::shared_ptr<test_sync_pool> sync = std::make_shared<test_sync_pool>();
+	// queue roles; compute and transfer fall back to the graphics family and queue if they were not asked for or not found
+	uint32_t graphics_family = 0;
+	uint32_t compute_family = 0;
+	uint32_t transfer_family = 0;
+	VkQueue graphics_queue = VK_NULL_HANDLE; // the first queue of family zero
+	VkQueue compute_queue = VK_NULL_HANDLE;
+	VkQueue transfer_queue = VK_NULL_HANDLE;
 	bool has_trace_helpers = false;
 	bool has_trace_helpers2 = false;
 	bool has_explicit_host_updates = false;
 	bool has_trace_descriptor_buffer = false;
 	bool garbage_pointers = false;
+	bool no_coherent = false; // from the gpu_no_coherent capability, prefer non-coherent host memory and always flush host writes
 };
 
 namespace acceleration_structures
@@ -152,7 +284,17 @@ struct dummy_ext { VkStructureType sType; dummy_ext* pNext; };
 
 vulkan_setup_t test_init(int argc, char** argv, const std::string& testname, vulkan_req_t& reqs);
 void test_done(vulkan_setup_t& vulkan, bool shared_instance = false);
+/// Run the test body once for each active scene, after applying its options, passing in the scene name. If no
+/// scenes are active, runs it once as set up by the command line, with an empty scene name.
+void test_run_scenes(vulkan_setup_t& vulkan, vulkan_req_t& reqs, const std::function<void(const std::string& scene)>& body);
 uint32_t get_device_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties);
+/// As above, but if prefer_non_coherent is set and host visible memory is asked for, pick a non-coherent memory type if there is one
+uint32_t get_device_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties, bool prefer_non_coherent);
+/// Pick the memory type the strategy ranks highest among those allowed by type_filter, from tables built by test_init().
+/// If prefer_non_coherent is set, pick the highest ranked non-coherent type if there is one.
+uint32_t get_device_memory_type(uint32_t type_filter, test_memory_strategy strategy, bool prefer_non_coherent = false);
+/// Property flags of a memory type
+VkMemoryPropertyFlags get_device_memory_flags(uint32_t memory_type);
 void test_set_name(const vulkan_setup_t& vulkan, VkObjectType type, uint64_t handle, const char* name);
 /// Add a test marker. Requires VK_EXT_debug_utils, but you do not need to add this to requirements yourself. It is added automatically and this is a no-op if it is not present.
 void test_marker(const vulkan_setup_t& vulkan, const std::string& text);
@@ -160,17 +302,68 @@ void test_marker(const vulkan_setup_t& vulkan, const std::string& text);
 void test_marker_mention(const vulkan_setup_t& vulkan, const std::string& text, VkObjectType type, uint64_t handle);
 
 uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vector<VkBuffer>& buffers, std::vector<VkDeviceMemory>& memory, bool deviceaddress, bool dedicated, bool pattern, const char* name);
+/// As above, but each buffer gets its own piece of the device memory arena, which must exist. Free them with test_arena_free().
+uint32_t testAllocateBufferMemory(const vulkan_setup_t& vulkan, const std::vector<VkBuffer>& buffers, std::vector<test_suballocation>& allocations, bool deviceaddress, bool pattern, const char* name);
 void testBindBufferMemory(const vulkan_setup_t& vulkan, const std::vector<VkBuffer>& buffers, VkDeviceMemory memory, VkDeviceSize offset, const char* name = nullptr);
 void testCmdCopyBuffer(const vulkan_setup_t& vulkan, VkCommandBuffer cmdbuf, const std::vector<VkBuffer>& origin, const std::vector<VkBuffer>& target, VkDeviceSize size);
 void testFreeMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory);
-void testFlushMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size = VK_WHOLE_SIZE, bool extra = false, VkMarkedOffsetsARM* markings = nullptr);
+/// Sub-allocate from the device memory arena, from the given memory type. Set linear to false for images with optimal tiling. Aborts if out of memory.
+test_suballocation test_arena_allocate(const vulkan_setup_t& vulkan, const VkMemoryRequirements& req, uint32_t memory_type, bool linear = true, bool device_address = false);
+void test_arena_free(const vulkan_setup_t& vulkan, test_suballocation& allocation);
+/// Book-keeping of live device memory per heap for the benchmarking results. Call right after allocating and before
+/// freeing device memory; testFreeMemory() does the latter for you. Unknown handles are ignored.
+void test_track_memory_alloc(VkDeviceMemory memory, uint32_t memoryTypeIndex, VkDeviceSize size);
+void test_track_memory_free(VkDeviceMemory memory);
+/// Flush host writes. An 'extra' flush is for information only, unless we run with non-coherent memory, in which case it is a real one.
+/// The range is widened to whole non-coherent atoms, so the memory must be mapped from map_offset, which must be a multiple of
+/// nonCoherentAtomSize.
+void testFlushMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size = VK_WHOLE_SIZE, bool extra = false, VkMarkedOffsetsARM* markings = nullptr, VkDeviceSize map_offset = 0);
+/// Make device writes visible to the host before reading them. Only does anything when we run with non-coherent memory.
+/// The memory must be mapped from map_offset, as for testFlushMemory().
+void testInvalidateMemory(const vulkan_setup_t& vulkan, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize map_offset = 0);
+/// Widen a flush or invalidate range to whole non-coherent atoms. If the end cannot be rounded up inside the allocation,
+/// the range is extended to the end of the mapping instead. The range never starts before the mapping at map_offset,
+/// which must itself be atom aligned, so map memory at an atom aligned offset if you need to flush or invalidate it.
+void test_align_memory_range(VkDeviceSize atom, VkDeviceSize& offset, VkDeviceSize& size, VkDeviceSize allocation_size = VK_WHOLE_SIZE, VkDeviceSize map_offset = 0);
+/// Whether host writes to memory from the common helpers need a flush call
+static inline bool test_needs_flush(const vulkan_setup_t& vulkan) { return vulkan.has_explicit_host_updates || vulkan.no_coherent; }
 
 /// Adds a dummy queue submit with a pipeline barrier that references the passed buffers in order to make tools not ignore them.
 void testQueueBuffer(const vulkan_setup_t& vulkan, VkQueue queue, const std::vector<VkBuffer>& buffers);
 
-/// Copy one buffer into another
+/// If GPU timestamps are enabled, add command buffers around the given ones that time their execution. The result is
+/// attached to the submitting thread's current benchmarking iteration when it stops. Submits to queue families that
+/// cannot write timestamps are left untimed.
+void test_gpu_timer_wrap(const vulkan_setup_t& vulkan, VkQueue queue, std::vector<VkCommandBuffer>& cmdbufs);
+
+/// Copy one buffer into another, and wait for it unless batching
 void testCopyBuffer(const vulkan_setup_t& vulkan, VkQueue queue, VkBuffer target, VkBuffer origin, VkDeviceSize size);
 
+/// Record the work of testCopyBuffer() and testQueueBuffer() on this queue into one command buffer instead of submitting
+/// and waiting for each call. Not thread safe, just like the queue itself.
+void test_batch_begin(const vulkan_setup_t& vulkan, VkQueue queue);
+/// Submit everything recorded since test_batch_begin() and wait for all of it at once
+void test_batch_end(const vulkan_setup_t& vulkan, VkQueue queue);
+
+/// Get an unsignaled fence, recycled if possible
+VkFence test_fence_acquire(const vulkan_setup_t& vulkan);
+/// Reset a fence and give it back for reuse. Any submit using it must have completed.
+void test_fence_release(const vulkan_setup_t& vulkan, VkFence fence);
+/// Get an unsignaled binary semaphore, recycled if possible
+VkSemaphore test_semaphore_acquire(const vulkan_setup_t& vulkan);
+/// Give a binary semaphore back for reuse. It must be unsignaled, ie the wait on its signal must have completed.
+void test_semaphore_release(const vulkan_setup_t& vulkan, VkSemaphore semaphore);
+/// Returns the timeline semaphore of the queue and sets value to the next value to signal on it, or returns
+/// VK_NULL_HANDLE if timeline semaphores are not enabled.
+VkSemaphore test_timeline_next(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t& value);
+/// Wait on the host until the timeline semaphore of the queue reaches the value
+void test_timeline_wait(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t value);
+/// Whether the timeline semaphore of the queue has reached the value, without waiting
+bool test_timeline_reached(const vulkan_setup_t& vulkan, VkQueue queue, uint64_t value);
+
+/// Queue family of a queue from the vulkan_setup_t queue roles, or zero for any other queue
+uint32_t test_queue_family(const vulkan_setup_t& vulkan, VkQueue queue);
+
 /// Select which GPU to use
 void select_gpu(int chosen_gpu);
 
@@ -127,13 +127,17 @@ int main(int argc, char** argv)
 		result = vkBindBufferMemory(vulkan.device, indirectBuffer, indirectMemory, 0);
 		check(result);
 
-		uint32_t* data = nullptr;
-		result = vkMapMemory(vulkan.device, indirectMemory, start_offset, VK_WHOLE_SIZE, 0, (void**)&data);
+		// flushes must start on a whole atom inside the mapping
+		const VkDeviceSize atom = vulkan.device_properties.limits.nonCoherentAtomSize;
+		const VkDeviceSize map_offset = start_offset - start_offset % atom;
+		char* mapped = nullptr;
+		result = vkMapMemory(vulkan.device, indirectMemory, map_offset, VK_WHOLE_SIZE, 0, (void**)&mapped);
 		assert(result == VK_SUCCESS);
+		uint32_t* data = (uint32_t*)(mapped + start_offset - map_offset);
 		data[0] = ceil(width / float(workgroup_size));
 		data[1] = ceil(height / float(workgroup_size));
 		data[2] = 1;
-		if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, indirectMemory, start_offset, VK_WHOLE_SIZE, true);
+		if (test_needs_flush(vulkan)) testFlushMemory(vulkan, indirectMemory, start_offset, VK_WHOLE_SIZE, true, nullptr, map_offset);
 		vkUnmapMemory(vulkan.device, indirectMemory);
 	}
 
@@ -141,7 +145,7 @@ int main(int argc, char** argv)
 
 	compute_create_pipeline(vulkan, r, req);
 
-	for (unsigned frame = 0; frame < p__loops; frame++)
+	for (unsigned frame = 0; bench_loop(vulkan.bench); frame++)
 	{
 		test_marker(vulkan, "Frame " + std::to_string(frame));
 		VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
@@ -164,6 +168,7 @@ int main(int argc, char** argv)
 
 		compute_submit(vulkan, r, req);
 	}
+	compute_wait(vulkan, r);
 
 	if (indirect)
 	{
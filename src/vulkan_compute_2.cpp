@@ -255,6 +255,8 @@ int main(int argc, char** argv)
 	req.usage = show_usage;
 	req.cmdopt = test_cmdopt;
 	req.queues = queues;
+	req.scenes = { { "sync_0", "synchronized with vkDeviceWaitIdle", { "-s", "0" } }, { "sync_1", "synchronized with vkQueueWaitIdle", { "-s", "1" } },
+	               { "sync_2", "synchronized with fences", { "-s", "2" } } };
 	vulkan_setup_t vulkan = test_init(argc, argv, "vulkan_compute_2", req);
 	VkResult result;
 	resources r{};
@@ -383,44 +385,46 @@ int main(int argc, char** argv)
 	for (unsigned i = 0; i < nodes; i++) result = vkCreateFence(vulkan.device, &fenceCreateInfo, NULL, &fences.at(i));
 	check(result);
 
-	bench_start_scene(vulkan.bench, "compute_2");
-	assert(p__loops > 0);
-	for (unsigned i = 0; i < p__loops; i++)
+	test_run_scenes(vulkan, req, [&](const std::string& scene)
 	{
-		test_marker(vulkan, "Frame " + std::to_string(i));
-		bench_start_iteration(vulkan.bench);
-		for (unsigned node = 0; node < nodes; node++)
+		bench_start_scene(vulkan.bench, scene.empty() ? "compute_2" : scene);
+		for (unsigned i = 0; bench_loop(vulkan.bench); i++)
 		{
-			VkPipelineStageFlags flag = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-			VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
-			submit.commandBufferCount = 1;
-			submit.pCommandBuffers = &r.commandBuffer.at(node);
-			submit.pWaitDstStageMask = &flag;
-			VkQueue queue = r.queues.at(node % queues);
+			test_marker(vulkan, "Frame " + std::to_string(i));
+			bench_start_iteration(vulkan.bench);
+			for (unsigned node = 0; node < nodes; node++)
+			{
+				VkPipelineStageFlags flag = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+				VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
+				submit.commandBufferCount = 1;
+				submit.pCommandBuffers = &r.commandBuffer.at(node);
+				submit.pWaitDstStageMask = &flag;
+				VkQueue queue = r.queues.at(node % queues);
 
-			if (sync_variant == 2) result = vkQueueSubmit(queue, 1, &submit, fences.at(node));
-			else result = vkQueueSubmit(queue, 1, &submit, VK_NULL_HANDLE);
+				if (sync_variant == 2) result = vkQueueSubmit(queue, 1, &submit, fences.at(node));
+				else result = vkQueueSubmit(queue, 1, &submit, VK_NULL_HANDLE);
 
-			check(result);
+				check(result);
+			}
+			if (sync_variant == 0) vkDeviceWaitIdle(vulkan.device);
+			else if (sync_variant == 1) { for (VkQueue q : r.queues) vkQueueWaitIdle(q); }
+			else if (sync_variant == 2)
+			{
+				result = vkWaitForFences(vulkan.device, nodes, fences.data(), VK_TRUE, UINT64_MAX);
+				check(result);
+				result = vkResetFences(vulkan.device, nodes, fences.data());
+				check(result);
+			}
+			bench_stop_iteration(vulkan.bench);
 		}
-		if (sync_variant == 0) vkDeviceWaitIdle(vulkan.device);
-		else if (sync_variant == 1) { for (VkQueue q : r.queues) vkQueueWaitIdle(q); }
-		else if (sync_variant == 2)
+
+		if (output)
 		{
-			result = vkWaitForFences(vulkan.device, nodes, fences.data(), VK_TRUE, UINT64_MAX);
-			check(result);
-			result = vkResetFences(vulkan.device, nodes, fences.data());
-			check(result);
+			test_save_image(vulkan, "mandelbrot.png", r.memory, 0, width, height);
+			bench_stop_scene(vulkan.bench, "mandelbrot.png");
 		}
-		bench_stop_iteration(vulkan.bench);
-	}
-
-	if (output)
-	{
-		test_save_image(vulkan, "mandelbrot.png", r.memory, 0, width, height);
-		bench_stop_scene(vulkan.bench, "mandelbrot.png");
-	}
-	else bench_stop_scene(vulkan.bench);
+		else bench_stop_scene(vulkan.bench);
+	});
 
 	for (unsigned i = 0; i < nodes; i++) vkDestroyFence(vulkan.device, fences.at(i), NULL);
 	for (unsigned i = 0; i < nodes; i++) vkDestroyBuffer(vulkan.device, r.buffer.at(i), NULL);
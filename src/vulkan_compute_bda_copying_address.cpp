@@ -296,7 +296,7 @@ static void populate_addressAndColorBuffer(uint32_t numPixelsPerBuffer)
 
 	if(p_benchmark->m_vulkanSetup.has_trace_helpers && p_benchmark->m_vulkanSetup.has_explicit_host_updates)
 	{
-		VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr,p_benchmark->m_addressBuffer->getMemory(), 0, VK_WHOLE_SIZE};
+		VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr,p_benchmark->m_addressBuffer->getMemory(), p_benchmark->m_addressBuffer->getMemoryOffset(), p_benchmark->m_addressBuffer->getSize()};
 		VkFlushRangesFlagsARM frf = { VK_STRUCTURE_TYPE_FLUSH_RANGES_FLAGS_ARM, nullptr, VK_FLUSH_OPERATION_INFORMATIVE_BIT_ARM };
 		VkMarkedOffsetsARM markings { VK_STRUCTURE_TYPE_MARKED_OFFSETS_ARM, nullptr, numPixels, marking_types.data(),sub_types.data(), offsets.data()};
 
@@ -308,6 +308,11 @@ static void populate_addressAndColorBuffer(uint32_t numPixelsPerBuffer)
 		result = vkFlushMappedMemoryRanges(p_benchmark->m_addressBuffer->m_device, 1, &range);
 		check(result);
 	}
+	else
+	{
+		p_benchmark->m_colorBuffer->flush(true);
+		p_benchmark->m_addressBuffer->flush(true);
+	}
 
 	p_benchmark->m_colorBuffer->unmap();
 	p_benchmark->m_addressBuffer->unmap();
@@ -351,7 +356,7 @@ static void render(const vulkan_setup_t& vulkan)
 
 	benchmarking bench = vulkan.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer defaultCmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 		vkResetCommandBuffer(defaultCmd, 0);
@@ -440,7 +445,7 @@ static void render(const vulkan_setup_t& vulkan)
 		bench_start_iteration(bench);
 
 		// submit
-		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence);
+		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence, {}, {}, false);
 
 		vkWaitForFences(vulkan.device, 1, &p_benchmark->m_frameFence, VK_TRUE, UINT64_MAX);
 		vkResetFences(vulkan.device, 1, &p_benchmark->m_frameFence);
@@ -107,7 +107,7 @@ int main(int argc, char** argv)
 	ar.pMarkingTypes = &markingType;
 	ar.pSubTypes = &subType;
 	if (vulkan.has_trace_helpers) testFlushMemory(vulkan, ubo_memory, 0, aligned_buffer_size, true, &ar);
-	else if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, ubo_memory, 0, aligned_buffer_size, true, nullptr);
+	else if (test_needs_flush(vulkan)) testFlushMemory(vulkan, ubo_memory, 0, aligned_buffer_size, true, nullptr);
 	vkUnmapMemory(vulkan.device, ubo_memory);
 
 	// generic setup
@@ -185,7 +185,7 @@ int main(int argc, char** argv)
 
 	compute_create_pipeline(vulkan, r, reqs);
 
-	for (unsigned frame = 0; frame < p__loops; frame++)
+	for (unsigned frame = 0; bench_loop(vulkan.bench); frame++)
 	{
 		test_marker(vulkan, "Frame " + std::to_string(frame));
 		VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
@@ -15,6 +15,8 @@ void compute_usage()
 	printf("-pcf/--cachefile N     Save and restore pipeline cache to/from file N\n");
 	printf("-fb/--frame-boundary   Use frameboundary extension to publicize output\n");
 	printf("-t/--times N           Times to repeat (default %d)\n", (int)p__loops);
+	printf("-fif/--frames-in-flight N Submit up to N frames before waiting for the oldest (default 1)\n");
+	printf("-ac/--async-compute    Run on a compute queue family without graphics, if there is one\n");
 }
 
 bool compute_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs)
@@ -54,6 +56,16 @@ bool compute_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs)
 		reqs.options["wg_size"] = get_arg(argv, ++i, argc);
 		return true;
 	}
+	else if (match(argv[i], "-fif", "--frames-in-flight"))
+	{
+		reqs.options["frames_in_flight"] = get_arg(argv, ++i, argc);
+		return true;
+	}
+	else if (match(argv[i], "-ac", "--async-compute"))
+	{
+		reqs.async_compute = true;
+		return true;
+	}
 	else if (match(argv[i], "-fb", "--frame-boundary"))
 	{
 		return enable_frame_boundary(reqs);
@@ -66,12 +78,13 @@ compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs)
 	compute_resources r;
 	VkResult result;
 
-	vkGetDeviceQueue(vulkan.device, 0, 0, &r.queue);
+	r.queue = vulkan.compute_queue;
 
 	// set defaults if not overridden
 	if (!reqs.options.count("width")) reqs.options["width"] = 640;
 	if (!reqs.options.count("height")) reqs.options["height"] = 480;
 	if (!reqs.options.count("wg_size")) reqs.options["wg_size"] = 32;
+	if (!reqs.options.count("frames_in_flight")) reqs.options["frames_in_flight"] = 1;
 
 	const uint32_t width = std::get<int>(reqs.options.at("width"));
 	const uint32_t height = std::get<int>(reqs.options.at("height"));
@@ -94,21 +107,48 @@ compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs)
 
 	VkCommandPoolCreateInfo commandPoolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
 	commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	commandPoolCreateInfo.queueFamilyIndex = 0; // TBD fix
+	commandPoolCreateInfo.queueFamilyIndex = vulkan.compute_family;
 	result = vkCreateCommandPool(vulkan.device, &commandPoolCreateInfo, NULL, &r.commandPool);
 	check(result);
 
+	const int frames_in_flight = std::get<int>(reqs.options.at("frames_in_flight"));
+	if (frames_in_flight < 1) ABORT("Need at least one frame in flight");
+	r.frames.resize(frames_in_flight);
 	VkCommandBufferAllocateInfo commandBufferAllocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr };
 	commandBufferAllocateInfo.commandPool = r.commandPool;
 	commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
 	commandBufferAllocateInfo.commandBufferCount = 1;
-	result = vkAllocateCommandBuffers(vulkan.device, &commandBufferAllocateInfo, &r.commandBuffer);
-	check(result);
-	result = vkAllocateCommandBuffers(vulkan.device, &commandBufferAllocateInfo, &r.commandBufferFrameBoundary);
-	check(result);
+	for (compute_frame& frame : r.frames)
+	{
+		result = vkAllocateCommandBuffers(vulkan.device, &commandBufferAllocateInfo, &frame.commandBuffer);
+		check(result);
+		result = vkAllocateCommandBuffers(vulkan.device, &commandBufferAllocateInfo, &frame.commandBufferFrameBoundary);
+		check(result);
+	}
+	r.commandBuffer = r.frames[0].commandBuffer;
+	r.commandBufferFrameBoundary = r.frames[0].commandBufferFrameBoundary;
+
+	if (frames_in_flight > 1)
+	{
+		vulkan.bench.run_info["frames_in_flight"] = frames_in_flight;
+
+		// all frames write the same output, so each must wait for the ones before it
+		result = vkAllocateCommandBuffers(vulkan.device, &commandBufferAllocateInfo, &r.commandBufferOrdering);
+		check(result);
+		VkCommandBufferBeginInfo orderingBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
+		orderingBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+		result = vkBeginCommandBuffer(r.commandBufferOrdering, &orderingBeginInfo);
+		check(result);
+		VkMemoryBarrier orderingBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr };
+		orderingBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		orderingBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(r.commandBufferOrdering, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &orderingBarrier, 0, nullptr, 0, nullptr);
+		result = vkEndCommandBuffer(r.commandBufferOrdering);
+		check(result);
+	}
 
 	// Create an image for the frame boundary, in case we need it
-	const uint32_t queueFamilyIndex = 0;
+	const uint32_t queueFamilyIndex = vulkan.compute_family;
 	VkImageCreateInfo imageCreateInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr };
 	imageCreateInfo.flags = 0;
 	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -128,17 +168,17 @@ compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs)
 	result = vkCreateImage(vulkan.device, &imageCreateInfo, nullptr, &r.image);
 	check(result);
 
+	// both are read back by the host, so prefer cached memory
 	VkMemoryRequirements memory_requirements = {};
 	vkGetImageMemoryRequirements(vulkan.device, r.image, &memory_requirements);
-	VkMemoryPropertyFlagBits memoryflags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-	const uint32_t memoryTypeIndex = get_device_memory_type(memory_requirements.memoryTypeBits, memoryflags);
+	const uint32_t image_type_bits = memory_requirements.memoryTypeBits;
 	uint32_t align_mod = memory_requirements.size % memory_requirements.alignment;
 	const uint32_t aligned_image_size = (align_mod == 0) ? memory_requirements.size : (memory_requirements.size + memory_requirements.alignment - align_mod);
 	uint32_t total_size = aligned_image_size;
 
 	vkGetBufferMemoryRequirements(vulkan.device, r.buffer, &memory_requirements);
-	const uint32_t memoryTypeIndex2 = get_device_memory_type(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	assert(memoryTypeIndex == memoryTypeIndex2); // else we're in trouble here
+	assert(image_type_bits & memory_requirements.memoryTypeBits); // else we're in trouble here
+	const uint32_t memoryTypeIndex = get_device_memory_type(image_type_bits & memory_requirements.memoryTypeBits, TEST_MEMORY_READBACK, vulkan.no_coherent);
 	align_mod = memory_requirements.size % memory_requirements.alignment;
 	const uint32_t aligned_buffer_size = (align_mod == 0) ? memory_requirements.size : (memory_requirements.size + memory_requirements.alignment - align_mod);
 	total_size += aligned_buffer_size;
@@ -158,6 +198,7 @@ compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs)
 	result = vkAllocateMemory(vulkan.device, &pAllocateMemInfo, nullptr, &r.memory);
 	check(result);
 	assert(r.memory != VK_NULL_HANDLE);
+	test_track_memory_alloc(r.memory, pAllocateMemInfo.memoryTypeIndex, pAllocateMemInfo.allocationSize);
 
 	if (vulkan.apiVersion >= VK_API_VERSION_1_1)
 	{
@@ -215,16 +256,36 @@ compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs)
 	return r;
 }
 
+static void compute_frame_wait(vulkan_setup_t& vulkan, compute_resources& r, compute_frame& frame)
+{
+	if (!frame.pending) return;
+	if (frame.fence != VK_NULL_HANDLE)
+	{
+		VkResult result = vkWaitForFences(vulkan.device, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+		check(result);
+		test_fence_release(vulkan, frame.fence);
+		frame.fence = VK_NULL_HANDLE;
+	}
+	else test_timeline_wait(vulkan, r.queue, frame.timelineValue);
+	frame.pending = false;
+}
+
+void compute_wait(vulkan_setup_t& vulkan, compute_resources& r)
+{
+	for (compute_frame& frame : r.frames) compute_frame_wait(vulkan, r, frame);
+}
+
 void compute_submit(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t& reqs)
 {
 	bench_start_scene(vulkan.bench, "compute");
 	bench_start_iteration(vulkan.bench);
 
-	VkFence fence;
-	VkFenceCreateInfo fenceCreateInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr };
-	fenceCreateInfo.flags = 0;
-	VkResult result = vkCreateFence(vulkan.device, &fenceCreateInfo, NULL, &fence);
-	check(result);
+	// wait on the queue timeline if we have one, otherwise on a recycled fence
+	compute_frame& frame = r.frames[r.current];
+	uint64_t timelineValue = 0;
+	VkSemaphore timeline = test_timeline_next(vulkan, r.queue, timelineValue);
+	VkFence fence = (timeline == VK_NULL_HANDLE) ? test_fence_acquire(vulkan) : VK_NULL_HANDLE;
+	VkResult result;
 
 	VkFrameBoundaryEXT fbinfo = { VK_STRUCTURE_TYPE_FRAME_BOUNDARY_EXT, nullptr };
 	fbinfo.flags = VK_FRAME_BOUNDARY_FRAME_END_BIT_EXT;
@@ -263,18 +324,35 @@ void compute_submit(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t&
 		cmdbufs.push_back(r.commandBufferFrameBoundary);
 		submitInfo.pNext = &fbinfo;
 	}
+	VkTimelineSemaphoreSubmitInfo timelineInfo = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO, submitInfo.pNext };
+	if (timeline != VK_NULL_HANDLE)
+	{
+		timelineInfo.signalSemaphoreValueCount = 1;
+		timelineInfo.pSignalSemaphoreValues = &timelineValue;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &timeline;
+		submitInfo.pNext = &timelineInfo;
+	}
+	test_gpu_timer_wrap(vulkan, r.queue, cmdbufs);
+	if (r.commandBufferOrdering != VK_NULL_HANDLE) cmdbufs.insert(cmdbufs.begin(), r.commandBufferOrdering);
+	submitInfo.commandBufferCount = cmdbufs.size();
 	submitInfo.pCommandBuffers = cmdbufs.data();
 	result = vkQueueSubmit(r.queue, 1, &submitInfo, fence);
 	check(result);
+	frame.fence = fence;
+	frame.timelineValue = timelineValue;
+	frame.pending = true;
 
-	result = vkWaitForFences(vulkan.device, 1, &fence, VK_TRUE, UINT64_MAX);
-	check(result);
-
-	vkDestroyFence(vulkan.device, fence, nullptr);
+	// with one frame in flight, this waits for the frame we just submitted
+	r.current = (r.current + 1) % r.frames.size();
+	compute_frame_wait(vulkan, r, r.frames[r.current]);
+	r.commandBuffer = r.frames[r.current].commandBuffer;
+	r.commandBufferFrameBoundary = r.frames[r.current].commandBufferFrameBoundary;
 
 	bench_stop_iteration(vulkan.bench);
 	if (reqs.options.count("image_output"))
 	{
+		compute_wait(vulkan, r);
 		std::string filename = "compute_" + std::to_string(r.frame) + ".png";
 		test_save_image(vulkan, filename.c_str(), r.memory, 0, std::get<int>(reqs.options.at("width")), std::get<int>(reqs.options.at("height")));
 		bench_stop_scene(vulkan.bench, filename.c_str());
@@ -286,6 +364,7 @@ void compute_submit(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t&
 
 void compute_done(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t& reqs)
 {
+	compute_wait(vulkan, r);
 	if (reqs.options.count("pipelinecache") && reqs.options.count("cachefile"))
 	{
 		std::string file = std::get<std::string>(reqs.options.at("cachefile"));
@@ -368,20 +447,18 @@ void compute_create_pipeline(vulkan_setup_t& vulkan, compute_resources& r, vulka
 
 	if (reqs.options.count("pipelinecache"))
 	{
-		char* blob = nullptr;
+		mapped_blob blob;
 		VkPipelineCacheCreateInfo cacheinfo = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr };
 		cacheinfo.flags = 0;
 		if (reqs.options.count("cachefile") && exists_blob(std::get<std::string>(reqs.options.at("cachefile"))))
 		{
 			ILOG("Reading pipeline cache data from %s", std::get<std::string>(reqs.options.at("cachefile")).c_str());
-			uint32_t size = 0;
-			blob = load_blob(std::get<std::string>(reqs.options.at("cachefile")), &size);
-			cacheinfo.initialDataSize = size;
-			cacheinfo.pInitialData = blob;
+			blob = mapped_blob(std::get<std::string>(reqs.options.at("cachefile")));
+			cacheinfo.initialDataSize = blob.size;
+			cacheinfo.pInitialData = blob.data;
 		}
 		result = vkCreatePipelineCache(vulkan.device, &cacheinfo, nullptr, &r.cache);
 		check(result);
-		free(blob);
 	}
 
 	result = vkCreateComputePipelines(vulkan.device, r.cache, 1, &pipelineCreateInfo, nullptr, &r.pipeline);
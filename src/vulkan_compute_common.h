@@ -2,6 +2,16 @@
 
 #include "vulkan_common.h"
 
+/// One of the frames in flight, see -fif/--frames-in-flight
+struct compute_frame
+{
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkCommandBuffer commandBufferFrameBoundary = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE; // if not waiting on the queue timeline
+	uint64_t timelineValue = 0;
+	bool pending = false;
+};
+
 struct compute_resources
 {
 	VkQueue queue = VK_NULL_HANDLE;
@@ -23,11 +33,19 @@ struct compute_resources
 	VkImage image = VK_NULL_HANDLE;
 	VkCommandBuffer commandBufferFrameBoundary = VK_NULL_HANDLE;
 	int frame = 0;
+
+	// commandBuffer and commandBufferFrameBoundary above are those of the current frame
+	std::vector<compute_frame> frames;
+	unsigned current = 0;
+	VkCommandBuffer commandBufferOrdering = VK_NULL_HANDLE; // barrier between frames, since they share their output
 };
 
 bool compute_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs);
 compute_resources compute_init(vulkan_setup_t& vulkan, vulkan_req_t& reqs);
 void compute_done(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t& reqs);
+/// Submit the current frame, then move on to the next one, waiting until it is no longer in flight
 void compute_submit(vulkan_setup_t& vulkan, compute_resources&  r, vulkan_req_t& reqs);
+/// Wait for all frames in flight. Call this before destroying anything they use.
+void compute_wait(vulkan_setup_t& vulkan, compute_resources& r);
 void compute_create_pipeline(vulkan_setup_t& vulkan, compute_resources& r, vulkan_req_t& reqs, uint32_t pipeline_flags = 0);
 void compute_usage();
@@ -132,14 +132,14 @@ int main(int argc, char** argv)
 		vkFlushMappedMemoryRanges(vulkan.device, 1, &mmr);
 	}
 
-	if (vulkan.has_explicit_host_updates) testFlushMemory(vulkan, memory, 0, 1024, true);
+	if (test_needs_flush(vulkan)) testFlushMemory(vulkan, memory, 0, 1024, true);
 	vkUnmapMemory(vulkan.device, memory);
 
 	r.code = copy_shader(vulkan_compute_1_spirv, vulkan_compute_1_spirv_len);
 
 	compute_create_pipeline(vulkan, r, req, VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT);
 
-	for (unsigned frame = 0; frame < p__loops; frame++)
+	for (unsigned frame = 0; bench_loop(vulkan.bench); frame++)
 	{
 		VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
 		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
@@ -163,6 +163,7 @@ int main(int argc, char** argv)
 
 		compute_submit(vulkan, r, req);
 	}
+	compute_wait(vulkan, r);
 
 	vkDestroyBuffer(vulkan.device, descriptor_buffer, nullptr);
 	vkFreeMemory(vulkan.device, memory, nullptr);
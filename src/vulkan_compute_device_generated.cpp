@@ -144,20 +144,18 @@ static void create_compute_pipeline_dgc(vulkan_setup_t& vulkan, compute_resource
 
 	if (reqs.options.count("pipelinecache"))
 	{
-		char* blob = nullptr;
+		mapped_blob blob;
 		VkPipelineCacheCreateInfo cache_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr };
 		cache_info.flags = 0;
 		if (reqs.options.count("cachefile") && exists_blob(std::get<std::string>(reqs.options.at("cachefile"))))
 		{
 			ILOG("Reading pipeline cache data from %s", std::get<std::string>(reqs.options.at("cachefile")).c_str());
-			uint32_t size = 0;
-			blob = load_blob(std::get<std::string>(reqs.options.at("cachefile")), &size);
-			cache_info.initialDataSize = size;
-			cache_info.pInitialData = blob;
+			blob = mapped_blob(std::get<std::string>(reqs.options.at("cachefile")));
+			cache_info.initialDataSize = blob.size;
+			cache_info.pInitialData = blob.data;
 		}
 		result = vkCreatePipelineCache(vulkan.device, &cache_info, nullptr, &r.cache);
 		check(result);
-		free(blob);
 	}
 
 	result = vkCreateComputePipelines(vulkan.device, r.cache, 1, &pipeline_info, nullptr, &r.pipeline);
@@ -366,7 +364,7 @@ int main(int argc, char** argv)
 	result = vkAllocateCommandBuffers(vulkan.device, &state_alloc_info, &state_cmd);
 	check(result);
 
-	for (unsigned frame = 0; frame < p__loops; ++frame)
+	for (unsigned frame = 0; bench_loop(vulkan.bench); ++frame)
 	{
 		test_marker(vulkan, "Frame " + std::to_string(frame));
 		VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
@@ -404,6 +402,7 @@ int main(int argc, char** argv)
 		compute_submit(vulkan, r, req);
 		vkResetCommandBuffer(state_cmd, 0);
 	}
+	compute_wait(vulkan, r);
 
 	pf_vkDestroyIndirectCommandsLayoutEXT(vulkan.device, indirect_layout, nullptr);
 	vkDestroyBuffer(vulkan.device, indirect_commands.buffer, nullptr);
@@ -174,7 +174,7 @@ int main(int argc, char** argv)
 	vkDestroyShaderModule(vulkan.device, r.computeShaderModule, nullptr);
 	r.computeShaderModule = VK_NULL_HANDLE;
 
-	for (unsigned frame = 0; frame < p__loops; frame++)
+	for (unsigned frame = 0; bench_loop(vulkan.bench); frame++)
 	{
 		test_marker(vulkan, "Frame " + std::to_string(frame));
 		VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr };
@@ -189,6 +189,7 @@ int main(int argc, char** argv)
 
 		compute_submit(vulkan, r, req);
 	}
+	compute_wait(vulkan, r);
 
 	if (r.image) vkDestroyImage(vulkan.device, r.image, nullptr);
 	vkDestroyBuffer(vulkan.device, r.buffer, nullptr);
@@ -9,7 +9,7 @@ static int fence_variant = 0;
 static unsigned buffer_size = (32 * 1024);
 static unsigned num_buffers = 10;
 static vulkan_req_t reqs;
-static bool dedicated_allocation = false;
+static int allocation_variant = 0;
 
 static void show_usage()
 {
@@ -25,12 +25,20 @@ static void show_usage()
 	printf("\t3 - one commandbuffer, one queue submit\n");
 	printf("\t4 - many commandbuffers, many queue submit calls\n");
 	printf("\t5 - many commandbuffers, many queue submit calls, two queues\n");
+	printf("\t6 - many commandbuffers, many queue submit calls, dedicated transfer queue if there is one\n");
+	printf("\t7 - the common one-shot copy helper, waiting for each copy\n");
+	printf("\t8 - the common one-shot copy helper, all copies batched into one submit\n");
 	printf("-m/--map-variant N     Set map variant (default %d)\n", map_variant);
 	printf("\t0 - memory map kept open\n");
 	printf("\t1 - memory map unmapped before submit\n");
 	printf("\t2 - memory map remapped to tiny area before submit\n");
 	printf("-B/--bufferdeviceaddress Create buffers with known buffer device addresses (requires Vulkan 1.2)\n");
-	printf("-DA/--dedicatedallocation Create one device memory for each buffer\n");
+	printf("-DA/--dedicatedallocation Create one device memory for each buffer, same as -a 1\n");
+	printf("-a/--allocation-variant N Set allocation variant (default %d)\n", allocation_variant);
+	printf("\t0 - one device memory for all buffers\n");
+	printf("\t1 - one device memory for each buffer\n");
+	printf("\t2 - buffers sub-allocated from a device memory arena, which keeps them mapped so the map variant is ignored\n");
+	printf("\tVariants 1 and 2 also time allocating and freeing the memory\n");
 }
 
 static void waitfence(vulkan_setup_t& vulkan, VkFence fence)
@@ -68,7 +76,8 @@ static bool test_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs)
 	{
 		queue_variant = get_arg(argv, ++i, argc);
 		if (queue_variant == 5) reqs.queues = 2;
-		return (queue_variant >= 0 && queue_variant <= 5);
+		if (queue_variant == 6) reqs.dedicated_transfer = true;
+		return (queue_variant >= 0 && queue_variant <= 8);
 	}
 	else if (match(argv[i], "-m", "--map-variant"))
 	{
@@ -87,23 +96,42 @@ static bool test_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs)
 	}
 	else if (match(argv[i], "-DA", "--dedicatedallocation"))
 	{
-		dedicated_allocation = true;
+		allocation_variant = 1;
 		return true;
 	}
+	else if (match(argv[i], "-a", "--allocation-variant"))
+	{
+		allocation_variant = get_arg(argv, ++i, argc);
+		if (allocation_variant == 2) reqs.suballocate = true;
+		return (allocation_variant >= 0 && allocation_variant <= 2);
+	}
 	return false;
 }
 
-static void copying_1(int argc, char** argv)
+/// Scene with all the variant options given, so that it does not inherit anything from the scene before it
+static test_scene variant_scene(int queue, int map, int fence = 0, unsigned count = 10, unsigned size = 32 * 1024, int allocation = 0)
+{
+	std::string name = "q" + std::to_string(queue) + "_m" + std::to_string(map);
+	if (fence != 0) name += "_f" + std::to_string(fence);
+	if (count != 10) name += "_c" + std::to_string(count);
+	if (size != 32 * 1024) name += "_b" + std::to_string(size);
+	if (allocation != 0) name += "_a" + std::to_string(allocation);
+	const std::string description = "queue variant " + std::to_string(queue) + ", map variant " + std::to_string(map) + ", fence variant " + std::to_string(fence)
+	                                + ", " + std::to_string(count) + " buffers of " + std::to_string(size) + " bytes"
+	                                + (allocation == 1 ? ", one device memory each" : allocation == 2 ? ", sub-allocated" : "");
+	return { name, description, { "-q", std::to_string(queue), "-m", std::to_string(map), "-f", std::to_string(fence), "-c", std::to_string(count), "-b", std::to_string(size),
+	                               "-a", std::to_string(allocation) } };
+}
+
+static void copying_1(vulkan_setup_t& vulkan)
 {
-	reqs.usage = show_usage;
-	reqs.cmdopt = test_cmdopt;
-	vulkan_setup_t vulkan = test_init(argc, argv, "vulkan_copying_1", reqs);
 	VkResult result;
 
 	VkQueue queue1;
 	VkQueue queue2;
 	vkGetDeviceQueue(vulkan.device, 0, 0, &queue1);
 	vkGetDeviceQueue(vulkan.device, 0, (queue_variant == 5) ? 1 : 0, &queue2);
+	if (queue_variant == 6) queue1 = queue2 = vulkan.transfer_queue;
 
 	std::vector<VkBuffer> origin_buffers(num_buffers);
 	std::vector<VkBuffer> target_buffers(num_buffers);
@@ -130,13 +158,31 @@ static void copying_1(int argc, char** argv)
 		assert(result == VK_SUCCESS);
 	}
 
+	const bool time_allocation = (allocation_variant != 0); // the point of these variants is to compare allocation cost
+	if (time_allocation) bench_start_iteration(vulkan.bench);
 	std::vector<VkDeviceMemory> origin_memory;
 	std::vector<VkDeviceMemory> target_memory;
-	uint32_t origin_aligned_size = testAllocateBufferMemory(vulkan, origin_buffers, origin_memory, reqs.bufferDeviceAddress, dedicated_allocation, true, "origin");
-	uint32_t target_aligned_size = testAllocateBufferMemory(vulkan, target_buffers, target_memory, reqs.bufferDeviceAddress, dedicated_allocation, false, "target");
+	std::vector<test_suballocation> origin_allocations;
+	std::vector<test_suballocation> target_allocations;
+	uint32_t origin_aligned_size;
+	uint32_t target_aligned_size;
+	if (allocation_variant == 2)
+	{
+		origin_aligned_size = testAllocateBufferMemory(vulkan, origin_buffers, origin_allocations, reqs.bufferDeviceAddress, true, "origin");
+		target_aligned_size = testAllocateBufferMemory(vulkan, target_buffers, target_allocations, reqs.bufferDeviceAddress, false, "target");
+	}
+	else
+	{
+		origin_aligned_size = testAllocateBufferMemory(vulkan, origin_buffers, origin_memory, reqs.bufferDeviceAddress, allocation_variant == 1, true, "origin");
+		target_aligned_size = testAllocateBufferMemory(vulkan, target_buffers, target_memory, reqs.bufferDeviceAddress, allocation_variant == 1, false, "target");
+	}
 	assert(origin_aligned_size == target_aligned_size);
 
-	if (dedicated_allocation && (map_variant == 0 || map_variant == 2))
+	if (allocation_variant == 2)
+	{
+		// already mapped by the arena
+	}
+	else if (allocation_variant == 1 && (map_variant == 0 || map_variant == 2))
 	{
 		char* data = nullptr;
 		for (unsigned i = 0; i < origin_buffers.size(); i++)
@@ -161,7 +207,7 @@ static void copying_1(int argc, char** argv)
 
 	VkCommandPoolCreateInfo command_pool_create_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr };
 	command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	command_pool_create_info.queueFamilyIndex = 0; // TBD - add transfer queue variant
+	command_pool_create_info.queueFamilyIndex = (queue_variant == 6) ? vulkan.transfer_family : 0;
 
 	VkCommandPool command_pool;
 	result = vkCreateCommandPool(vulkan.device, &command_pool_create_info, NULL, &command_pool);
@@ -194,8 +240,8 @@ static void copying_1(int argc, char** argv)
 	testCmdCopyBuffer(vulkan, command_buffers.at(num_buffers), origin_buffers, target_buffers, buffer_size);
 	result = vkEndCommandBuffer(command_buffers.at(num_buffers));
 	check(result);
-	bench_start_iteration(vulkan.bench);
-	if (queue_variant == 0 || queue_variant == 4 || queue_variant == 5)
+	if (!time_allocation) bench_start_iteration(vulkan.bench);
+	if (queue_variant == 0 || queue_variant == 4 || queue_variant == 5 || queue_variant == 6)
 	{
 		std::vector<VkFence> fences(num_buffers);
 		for (unsigned i = 0; i < num_buffers; i++)
@@ -213,7 +259,7 @@ static void copying_1(int argc, char** argv)
 			check(result);
 			if (queue_variant == 0) waitfence(vulkan, fences[i]);
 		}
-		if (queue_variant == 4 || queue_variant == 5)
+		if (queue_variant == 4 || queue_variant == 5 || queue_variant == 6)
 		{
 			result = vkWaitForFences(vulkan.device, num_buffers, fences.data(), VK_TRUE, UINT64_MAX);
 			check(result);
@@ -258,6 +304,12 @@ static void copying_1(int argc, char** argv)
 		check(result);
 		waitfence(vulkan, fence); // only one fence...
 	}
+	else if (queue_variant == 7 || queue_variant == 8) // what tests using the common helpers do, with and without batching
+	{
+		if (queue_variant == 8) test_batch_begin(vulkan, queue1);
+		for (unsigned i = 0; i < num_buffers; i++) testCopyBuffer(vulkan, queue1, target_buffers.at(i), origin_buffers.at(i), buffer_size);
+		if (queue_variant == 8) test_batch_end(vulkan, queue1);
+	}
 
 	// Verification
 	if (vulkan.vkAssertBuffer)
@@ -277,7 +329,7 @@ static void copying_1(int argc, char** argv)
 		}
 	}
 
-	bench_stop_iteration(vulkan.bench);
+	if (!time_allocation) bench_stop_iteration(vulkan.bench);
 
 	// Cleanup...
 	if (map_variant == 0 || map_variant == 2) for (unsigned i = 0; i < origin_memory.size(); i++) vkUnmapMemory(vulkan.device, origin_memory[i]);
@@ -290,13 +342,29 @@ static void copying_1(int argc, char** argv)
 
 	for (unsigned i = 0; i < origin_memory.size(); i++) testFreeMemory(vulkan, origin_memory[i]);
 	for (unsigned i = 0; i < target_memory.size(); i++) testFreeMemory(vulkan, target_memory[i]);
+	for (test_suballocation& a : origin_allocations) test_arena_free(vulkan, a);
+	for (test_suballocation& a : target_allocations) test_arena_free(vulkan, a);
+	if (time_allocation) bench_stop_iteration(vulkan.bench);
 	vkFreeCommandBuffers(vulkan.device, command_pool, num_buffers + 1, command_buffers.data());
 	vkDestroyCommandPool(vulkan.device, command_pool, nullptr);
-	test_done(vulkan);
 }
 
 int main(int argc, char** argv)
 {
-	copying_1(argc, argv);
+	reqs.usage = show_usage;
+	reqs.cmdopt = test_cmdopt;
+	reqs.scenes = { variant_scene(0, 0), variant_scene(1, 0, 0, 5), variant_scene(2, 0), variant_scene(3, 0), variant_scene(4, 0), variant_scene(0, 1, 0, 7),
+	                variant_scene(0, 0, 1), variant_scene(0, 2), variant_scene(1, 1), variant_scene(2, 1), variant_scene(3, 1), variant_scene(4, 1),
+	                variant_scene(1, 2), variant_scene(2, 2), variant_scene(3, 2), variant_scene(4, 2, 0, 10, 1000), variant_scene(6, 0),
+	                variant_scene(0, 0, 0, 10, 32 * 1024, 2), variant_scene(3, 0, 0, 100, 32 * 1024, 1), variant_scene(3, 0, 0, 100, 32 * 1024, 2),
+	                variant_scene(7, 0, 0, 100), variant_scene(8, 0, 0, 100) };
+	vulkan_setup_t vulkan = test_init(argc, argv, "vulkan_copying_1", reqs);
+	test_run_scenes(vulkan, reqs, [&](const std::string& scene)
+	{
+		if (!scene.empty()) bench_start_scene(vulkan.bench, scene);
+		copying_1(vulkan);
+		if (!scene.empty()) bench_stop_scene(vulkan.bench);
+	});
+	test_done(vulkan);
 	return 0;
 }
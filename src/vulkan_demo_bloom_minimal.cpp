@@ -226,7 +226,7 @@ static void render(const vulkan_setup_t& vulkan)
 	bool first_loop = true;
 	benchmarking bench = vulkan.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer cmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 
@@ -283,7 +283,7 @@ static void render(const vulkan_setup_t& vulkan)
 		bench_start_iteration(bench);
 		p_benchmark->submit(p_benchmark->m_defaultQueue,
 		                    std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer},
-		                    p_benchmark->frameFence);
+		                    p_benchmark->frameFence, {}, {}, false);
 
 		first_loop = false;
 	}
@@ -323,7 +323,7 @@ int main(int argc, char** argv)
 	scene_data.view = glm::mat4(1.0f);
 	scene_data.model = glm::mat4(1.0f);
 	memcpy(sceneUbo->m_mappedAddress, &scene_data, sizeof(scene_data));
-	sceneUbo->flush(true);
+	sceneUbo->flush(true, 0, sizeof(scene_data));
 	sceneUbo->unmap();
 
 	auto blurUbo = std::make_unique<Buffer>(vulkan);
@@ -333,7 +333,7 @@ int main(int argc, char** argv)
 	BlurUBO blur_data{};
 	blur_data.params = glm::vec4(1.0f, 1.5f, 0.0f, 0.0f);
 	memcpy(blurUbo->m_mappedAddress, &blur_data, sizeof(blur_data));
-	blurUbo->flush(true);
+	blurUbo->flush(true, 0, sizeof(blur_data));
 	blurUbo->unmap();
 
 	auto sampler = std::make_unique<Sampler>(vulkan.device);
@@ -235,7 +235,7 @@ static void render(const vulkan_setup_t& vulkan)
 	bool first_loop = true;
 	benchmarking bench = vulkan.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer cmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 
@@ -297,7 +297,7 @@ static void render(const vulkan_setup_t& vulkan)
 		bench_start_iteration(bench);
 		p_benchmark->submit(p_benchmark->m_defaultQueue,
 		                    std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer},
-		                    p_benchmark->frameFence);
+		                    p_benchmark->frameFence, {}, {}, false);
 
 		first_loop = false;
 	}
@@ -345,7 +345,7 @@ int main(int argc, char** argv)
 	camera_data.projection = glm::mat4(1.0f);
 	camera_data.view = glm::mat4(1.0f);
 	memcpy(cameraUbo->m_mappedAddress, &camera_data, sizeof(camera_data));
-	cameraUbo->flush(true);
+	cameraUbo->flush(true, 0, sizeof(camera_data));
 	cameraUbo->unmap();
 
 	auto modelUbo = std::make_unique<Buffer>(vulkan);
@@ -355,7 +355,7 @@ int main(int argc, char** argv)
 	ModelUBO model_data{};
 	model_data.model = glm::mat4(1.0f);
 	memcpy(modelUbo->m_mappedAddress, &model_data, sizeof(model_data));
-	modelUbo->flush(true);
+	modelUbo->flush(true, 0, sizeof(model_data));
 	modelUbo->unmap();
 
 	const uint32_t tex_extent = 4;
@@ -441,8 +441,8 @@ int main(int argc, char** argv)
 	p_benchmark->imageDesc.buffer->flush(true);
 	if (vulkan.has_explicit_host_updates)
 	{
-		testFlushMemory(vulkan, p_benchmark->uniformDesc.buffer->getMemory(), 0, p_benchmark->uniformDesc.buffer->getSize(), true);
-		testFlushMemory(vulkan, p_benchmark->imageDesc.buffer->getMemory(), 0, p_benchmark->imageDesc.buffer->getSize(), true);
+		testFlushMemory(vulkan, p_benchmark->uniformDesc.buffer->getMemory(), p_benchmark->uniformDesc.buffer->getMemoryOffset(), p_benchmark->uniformDesc.buffer->getSize(), true);
+		testFlushMemory(vulkan, p_benchmark->imageDesc.buffer->getMemory(), p_benchmark->imageDesc.buffer->getMemoryOffset(), p_benchmark->imageDesc.buffer->getSize(), true);
 	}
 	p_benchmark->uniformDesc.buffer->unmap();
 	p_benchmark->imageDesc.buffer->unmap();
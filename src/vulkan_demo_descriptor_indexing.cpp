@@ -170,7 +170,7 @@ static void render(const vulkan_setup_t& vulkan)
 	bool first_loop = true;
 	benchmarking bench = vulkan.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer cmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 
@@ -210,7 +210,7 @@ static void render(const vulkan_setup_t& vulkan)
 		bench_start_iteration(bench);
 		p_benchmark->submit(p_benchmark->m_defaultQueue,
 		                    std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer},
-		                    p_benchmark->frameFence);
+		                    p_benchmark->frameFence, {}, {}, false);
 
 		first_loop = false;
 	}
@@ -302,7 +302,7 @@ int main(int argc, char** argv)
 	uniform_data.view = glm::mat4(1.0f);
 	uniform_data.model = glm::mat4(1.0f);
 	memcpy(uniformBuffer->m_mappedAddress, &uniform_data, sizeof(uniform_data));
-	uniformBuffer->flush(true);
+	uniformBuffer->flush(true, 0, sizeof(uniform_data));
 	uniformBuffer->unmap();
 
 	p_benchmark->submitStaging(true, {}, {}, false);
@@ -271,6 +271,7 @@ void prepare_descriptor_buffer()
 	dst = descriptor_buffer_ptr + p_benchmark->m_layoutSize + p_benchmark->m_binding0Offset;
 	pf_vkGetDescriptorEXT(p_benchmark->m_vulkanSetup.device, &getInfo, descSize, dst);
 
+	p_benchmark->m_descBuffer->flush(true);
 	p_benchmark->m_descBuffer->unmap();
 }
 
@@ -445,6 +446,7 @@ void prepare_object()
 	p_benchmark->m_indirectDrawBuffer->map();
 	uint8_t* ptr = (uint8_t*)p_benchmark->m_indirectDrawBuffer->m_mappedAddress;
 	std::memset(ptr, 0, size);
+	p_benchmark->m_indirectDrawBuffer->flush(true, 0, size);
 	p_benchmark->m_indirectDrawBuffer->unmap();
 
 	update_object();
@@ -482,7 +484,7 @@ static void render()
 
 	benchmarking bench = p_benchmark->m_vulkanSetup.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer defaultCmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 		vkResetCommandBuffer(defaultCmd, 0);
@@ -565,7 +567,7 @@ static void render()
 		bench_start_iteration(bench);
 
 		// submit
-		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence);
+		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence, {}, {}, false);
 		vkWaitForFences(p_benchmark->m_vulkanSetup.device, 1, &p_benchmark->m_frameFence, VK_TRUE, UINT64_MAX);
 		vkResetFences(p_benchmark->m_vulkanSetup.device, 1, &p_benchmark->m_frameFence);
 
@@ -355,7 +355,7 @@ void updateTransformData(Buffer& dstBuffer)
 
 	assert(dstBuffer.m_mappedAddress!=nullptr);
 	memcpy(dstBuffer.m_mappedAddress, &ubo, sizeof(ubo));
-	dstBuffer.flush(true);
+	dstBuffer.flush(true, 0, sizeof(ubo));
 }
 
 static void save_texture_debug(const vulkan_setup_t& vulkan, Image& image, uint32_t width, uint32_t height)
@@ -389,7 +389,7 @@ static void save_texture_debug(const vulkan_setup_t& vulkan, Image& image, uint3
 	check(result);
 	vkDestroyFence(vulkan.device, fence, nullptr);
 
-	test_save_image(vulkan, "texture_upload.png", staging->getMemory(), 0, width, height, image.m_format);
+	test_save_image(vulkan, "texture_upload.png", staging->getMemory(), staging->getMemoryOffset(), width, height, image.m_format);
 }
 
 static void render(const vulkan_setup_t& vulkan)
@@ -397,7 +397,7 @@ static void render(const vulkan_setup_t& vulkan)
 	bool first_loop = true;
 	benchmarking bench = vulkan.bench;
 
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		VkCommandBuffer defaultCmd = p_benchmark->m_defaultCommandBuffer->getHandle();
 
@@ -449,7 +449,7 @@ static void render(const vulkan_setup_t& vulkan)
 		bench_start_iteration(bench);
 
 		// submit
-		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence);
+		p_benchmark->submit(p_benchmark->m_defaultQueue, std::vector<std::shared_ptr<CommandBuffer>> {p_benchmark->m_defaultCommandBuffer}, p_benchmark->m_frameFence, {}, {}, false);
 
 		first_loop = false;
 	}
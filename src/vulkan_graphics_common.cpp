@@ -80,6 +80,12 @@ VkResult Buffer::create(VkBufferUsageFlags usage, VkDeviceSize size, VkMemoryPro
 	return create();
 }
 
+VkResult Buffer::create(VkBufferUsageFlags usage, VkDeviceSize size, test_memory_strategy strategy, const std::vector<uint32_t>& queueFamilyIndices /* = { }*/)
+{
+	m_memoryStrategy = strategy;
+	return create(usage, size, 0, queueFamilyIndices);
+}
+
 VkResult Buffer::create(const BufferCreateInfoFunc& createInfoFunc, const AllocationCreateInfoFunc& allocationInfoFunc)
 {
 	createInfoFunc(m_createInfo);
@@ -91,28 +97,59 @@ VkResult Buffer::map(VkDeviceSize offset/*=0*/, VkDeviceSize size/*=VK_WHOLE_SIZ
 {
 	VkResult result;
 
-	result = vkMapMemory(m_device, m_memory, offset, size, flag, &m_mappedAddress);
+	if (m_suballocation.memory != VK_NULL_HANDLE) // kept mapped by the arena
+	{
+		assert(m_suballocation.mapped);
+		m_mappedAddress = m_suballocation.mapped + offset;
+		return VK_SUCCESS;
+	}
+	// map from a whole atom, as flushes and invalidates must start on one and lie inside the mapping
+	const VkDeviceSize atom = std::max<VkDeviceSize>(atom_size, 1);
+	m_mapOffset = offset - offset % atom;
+	if (size != VK_WHOLE_SIZE) size += offset - m_mapOffset;
+	result = vkMapMemory(m_device, m_memory, m_mapOffset, size, flag, &m_mappedAddress);
 	check(result);
+	m_mappedAddress = (char*)m_mappedAddress + (offset - m_mapOffset);
 	return result;
 }
 
-void Buffer::flush(bool extra)
+void Buffer::flush(bool extra, VkDeviceSize offset/*=0*/, VkDeviceSize size/*=VK_WHOLE_SIZE*/)
 {
 	if (!emit_extra_flushes && extra) return;
+	if (size == VK_WHOLE_SIZE && m_suballocation.memory != VK_NULL_HANDLE) size = m_allocateInfo.allocationSize - offset; // not the rest of the block
+	offset += m_suballocation.offset;
+	if (no_coherent) extra = false; // then the flush is needed
+	// ranges must cover whole atoms even for informative flushes, and widening them is harmless on coherent memory
+	test_align_memory_range(atom_size, offset, size, m_suballocation.offset + m_allocateInfo.allocationSize, m_mapOffset);
 	VkFlushRangesFlagsARM frf = { VK_STRUCTURE_TYPE_FLUSH_RANGES_FLAGS_ARM, nullptr };
 	frf.flags = VK_FLUSH_OPERATION_INFORMATIVE_BIT_ARM;
 	VkMappedMemoryRange mmr = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
 	if (extra) mmr.pNext = &frf;
 	mmr.memory = m_memory;
-	mmr.offset = 0;
-	mmr.size = VK_WHOLE_SIZE;
+	mmr.offset = offset;
+	mmr.size = size;
 	vkFlushMappedMemoryRanges(m_device, 1, &mmr);
 }
 
+void Buffer::invalidate(VkDeviceSize offset/*=0*/, VkDeviceSize size/*=VK_WHOLE_SIZE*/)
+{
+	if (!no_coherent) return;
+	if (size == VK_WHOLE_SIZE && m_suballocation.memory != VK_NULL_HANDLE) size = m_allocateInfo.allocationSize - offset;
+	offset += m_suballocation.offset;
+	test_align_memory_range(atom_size, offset, size, m_suballocation.offset + m_allocateInfo.allocationSize, m_mapOffset);
+	VkMappedMemoryRange mmr = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
+	mmr.memory = m_memory;
+	mmr.offset = offset;
+	mmr.size = size;
+	VkResult result = vkInvalidateMappedMemoryRanges(m_device, 1, &mmr);
+	check(result);
+}
+
 void Buffer::unmap()
 {
-	if (m_mappedAddress) vkUnmapMemory(m_device, m_memory);
+	if (m_mappedAddress && m_suballocation.memory == VK_NULL_HANDLE) vkUnmapMemory(m_device, m_memory);
 	m_mappedAddress = nullptr;
+	m_mapOffset = 0;
 }
 
 VkDeviceAddress Buffer::getBufferDeviceAddress()
@@ -149,9 +186,18 @@ VkResult Buffer::destroy()
 
 		unmap();
 		vkDestroyBuffer(m_device, m_handle, nullptr);
-		vkFreeMemory(m_device, m_memory, nullptr);
+		if (m_suballocation.memory != VK_NULL_HANDLE)
+		{
+			test_arena_free(vulkan2, m_suballocation);
+		}
+		else
+		{
+			test_track_memory_free(m_memory);
+			vkFreeMemory(m_device, m_memory, nullptr);
+		}
 		m_handle = VK_NULL_HANDLE;
 		m_memory = VK_NULL_HANDLE;
+		m_memoryStrategy = TEST_MEMORY_STRATEGIES;
 		m_deviceAddress = 0;
 
 		m_createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, nullptr };
@@ -171,27 +217,44 @@ VkResult Buffer::create()
 
 	const uint32_t alignMod = memRequirements.size % memRequirements.alignment;
 	const uint32_t alignedSize = (alignMod == 0) ? memRequirements.size : (memRequirements.size + memRequirements.alignment - alignMod);
-	const uint32_t memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, m_memoryProperty);
+	uint32_t memoryTypeIndex;
+	if (m_memoryStrategy != TEST_MEMORY_STRATEGIES)
+	{
+		memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, m_memoryStrategy, no_coherent);
+		m_memoryProperty = get_device_memory_flags(memoryTypeIndex);
+	}
+	else memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, m_memoryProperty, no_coherent);
 
 	m_allocateInfo.memoryTypeIndex = memoryTypeIndex;
 	m_allocateInfo.allocationSize = alignedSize;
 
-	result = vkAllocateMemory(m_device, &m_allocateInfo, nullptr, &m_memory);
-	check(result);
-	assert(m_memory != VK_NULL_HANDLE);
+	// Sub-allocate if the test asked for it, unless there are allocation parameters the arena does not know about
+	if (vulkan2.arena && m_allocateInfo.pNext == m_pAllocateNext)
+	{
+		const bool device_address = (m_createInfo.usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+		m_suballocation = test_arena_allocate(vulkan2, memRequirements, memoryTypeIndex, true, device_address);
+		m_memory = m_suballocation.memory;
+	}
+	else
+	{
+		result = vkAllocateMemory(m_device, &m_allocateInfo, nullptr, &m_memory);
+		check(result);
+		assert(m_memory != VK_NULL_HANDLE);
+		test_track_memory_alloc(m_memory, m_allocateInfo.memoryTypeIndex, m_allocateInfo.allocationSize);
+	}
 
 	if (vulkan2.apiVersion >= VK_API_VERSION_1_1)
 	{
 		VkBindBufferMemoryInfo bindBufferInfo = { VK_STRUCTURE_TYPE_BIND_BUFFER_MEMORY_INFO, nullptr };
 		bindBufferInfo.buffer = m_handle;
 		bindBufferInfo.memory = m_memory;
-		bindBufferInfo.memoryOffset = 0;
+		bindBufferInfo.memoryOffset = m_suballocation.offset;
 
 		result = vkBindBufferMemory2(m_device, 1, &bindBufferInfo);
 	}
 	else
 	{
-		result = vkBindBufferMemory(m_device, m_handle, m_memory, 0);
+		result = vkBindBufferMemory(m_device, m_handle, m_memory, m_suballocation.offset);
 	}
 	check(result);
 
@@ -250,7 +313,8 @@ VkResult Image::create(VkExtent3D extent, VkFormat format, VkImageUsageFlags usa
 	const uint32_t alignedSize = (alignMod == 0) ? memRequirements.size : (memRequirements.size + memRequirements.alignment - alignMod);
 
 	VkMemoryAllocateInfo allocateMemInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
-	allocateMemInfo.memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, properties);
+	if (properties == VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) allocateMemInfo.memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, TEST_MEMORY_DEVICE_LOCAL);
+	else allocateMemInfo.memoryTypeIndex = get_device_memory_type(memRequirements.memoryTypeBits, properties);
 	allocateMemInfo.allocationSize = alignedSize;
 
 	VkMemoryAllocateFlagsInfo flaginfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO, nullptr, 0, 0 };
@@ -267,6 +331,7 @@ VkResult Image::create(VkExtent3D extent, VkFormat format, VkImageUsageFlags usa
 	result = vkAllocateMemory(m_device, &allocateMemInfo, nullptr, &m_memory);
 	check(result);
 	assert(m_memory != VK_NULL_HANDLE);
+	test_track_memory_alloc(m_memory, allocateMemInfo.memoryTypeIndex, allocateMemInfo.allocationSize);
 
 	if (vulkan2.apiVersion >= VK_API_VERSION_1_1)
 	{
@@ -330,6 +395,7 @@ VkResult Image::destroy()
 	DLOG3("MEM detection: image destroy().");
 
 	vkDestroyImage(m_device, m_handle, nullptr);
+	test_track_memory_free(m_memory);
 	vkFreeMemory(m_device, m_memory, nullptr);
 	m_handle = VK_NULL_HANDLE;
 	m_memory = VK_NULL_HANDLE;
@@ -1562,67 +1628,123 @@ VkResult ComputePipeline::destroy()
 	return result;
 }
 
-void GraphicContext::updateBuffer(const char* srcData, VkDeviceSize size, const Buffer& dstBuffer, VkDeviceSize dstOffset /*=0*/, VkDeviceSize srcOffset /*=0*/, bool submitOnce /*=false*/ )
+const Buffer& GraphicContext::stagingWrite(const char* srcData, VkDeviceSize size, VkDeviceSize granularity, VkDeviceSize& offset)
+{
+	if (size > m_stagingRingSize) // never fits, give it its own buffer that lives as long as its batch
+	{
+		auto staging = std::make_unique<Buffer>(m_vulkanSetup);
+		staging->create(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		staging->map();
+		memcpy(staging->m_mappedAddress, srcData, (size_t)size);
+		staging->flush(true); // all of it, which is a valid range whatever the size
+		staging->unmap();
+		offset = 0;
+		m_stagingOpen.oversized.push_back(std::move(staging));
+		return *m_stagingOpen.oversized.back();
+	}
+
+	if (!m_stagingRing)
+	{
+		const VkPhysicalDeviceLimits& limits = m_vulkanSetup.device_properties.limits;
+		m_stagingAlignment = std::max<VkDeviceSize>({ 16, limits.optimalBufferCopyOffsetAlignment, limits.nonCoherentAtomSize });
+		m_stagingRing = std::make_unique<Buffer>(m_vulkanSetup);
+		m_stagingRing->create(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, m_stagingRingSize, TEST_MEMORY_STREAMING);
+		m_stagingRing->map();
+	}
+
+	stagingRetire(false);
+	if (m_stagingInFlight.empty() && !m_stagingOpen.commandBuffer) m_stagingHead = 0; // all idle, start over
+	const VkDeviceSize alignment = m_stagingAlignment * granularity;
+	offset = (m_stagingHead + alignment - 1) / alignment * alignment;
+	if (offset + size > m_stagingRingSize) // wrap around, so wait for everything before the head
+	{
+		submitStaging(false, { }, { }, false);
+		stagingRetire(true);
+		offset = 0;
+	}
+	m_stagingHead = offset + size;
+
+	memcpy((char*)m_stagingRing->m_mappedAddress + offset, srcData, (size_t)size);
+	m_stagingRing->flush(true, offset, std::min(aligned_size(size, m_stagingAlignment), m_stagingRingSize - offset)); // whole atoms, as the offset is
+	return *m_stagingRing;
+}
+
+CommandBuffer& GraphicContext::stagingCommandBuffer()
 {
-	auto staging = std::make_unique<Buffer>(m_vulkanSetup);
-	staging->create(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	if (!m_stagingOpen.commandBuffer)
+	{
+		if (m_stagingFreeCommandBuffers.empty())
+		{
+			m_stagingOpen.commandBuffer = std::make_shared<CommandBuffer>(m_defaultCommandPool);
+			m_stagingOpen.commandBuffer->create(VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+		}
+		else
+		{
+			m_stagingOpen.commandBuffer = m_stagingFreeCommandBuffers.back();
+			m_stagingFreeCommandBuffers.pop_back();
+		}
+		m_stagingOpen.commandBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT); // implicitly resets it
+	}
+	return *m_stagingOpen.commandBuffer;
+}
 
-	staging->map();
-	memcpy(staging->m_mappedAddress, srcData, (size_t)size);
-	staging->flush(true);
-	staging->unmap();
+void GraphicContext::stagingRetire(bool wait)
+{
+	while (!m_stagingInFlight.empty())
+	{
+		StagingBatch& batch = m_stagingInFlight.front();
+		VkResult result = wait ? vkWaitForFences(m_vulkanSetup.device, 1, &batch.fence, VK_TRUE, UINT64_MAX) : vkGetFenceStatus(m_vulkanSetup.device, batch.fence);
+		if (result == VK_NOT_READY) break;
+		check(result);
+		test_fence_release(m_vulkanSetup, batch.fence);
+		m_stagingFreeCommandBuffers.push_back(batch.commandBuffer);
+		m_stagingInFlight.pop_front(); // also frees its oversized staging buffers
+	}
+}
 
-	auto commandBufferStaging = std::make_shared<CommandBuffer>(m_defaultCommandPool);
-	commandBufferStaging->create(VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+void GraphicContext::stagingDestroy()
+{
+	stagingRetire(true);
+	m_stagingFreeCommandBuffers.clear();
+	m_stagingOpen = StagingBatch(); // recorded but never submitted
+	m_stagingRing = nullptr;
+	m_stagingHead = 0;
+}
 
-	commandBufferStaging->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-	commandBufferStaging->copyBuffer(*staging, dstBuffer, size, srcOffset, dstOffset);
-	commandBufferStaging->end();
+void GraphicContext::updateBuffer(const char* srcData, VkDeviceSize size, const Buffer& dstBuffer, VkDeviceSize dstOffset /*=0*/, VkDeviceSize srcOffset /*=0*/, bool submitOnce /*=false*/ )
+{
+	VkDeviceSize offset;
+	const Buffer& staging = stagingWrite(srcData, size, 1, offset);
 
-	m_stagingCommandBuffers.push_back(std::move(commandBufferStaging));
+	stagingCommandBuffer().copyBuffer(staging, dstBuffer, size, offset + srcOffset, dstOffset);
 
 	// submit the command buffer immediately
 	if (submitOnce)
 		submitStaging(true, { }, { }, false);
-
-	m_usingBuffers.push_back(std::move(staging));
 }
 
 void GraphicContext::updateImage(const char* srcData, VkDeviceSize size, Image& dstImage, const VkExtent3D& dstExtent, const VkOffset3D & dstOffset /*={0,0,0}*/, VkDeviceSize srcOffset /*=0*/, bool submitOnce /*=false*/)
 {
-	auto staging = std::make_unique<Buffer>(m_vulkanSetup);
-	staging->create(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	// copy offsets must be a multiple of the texel size, which can be 3, 6 or 12 bytes
+	VkDeviceSize offset;
+	const Buffer& staging = stagingWrite(srcData, size, 3, offset);
 
-	staging->map();
-	memcpy(staging->m_mappedAddress, srcData, (size_t)size);
-	staging->flush(true);
-	staging->unmap();
-
-	auto commandBufferStaging = std::make_shared<CommandBuffer>(m_defaultCommandPool);
-	commandBufferStaging->create(VK_COMMAND_BUFFER_LEVEL_PRIMARY);
-
-	commandBufferStaging->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-	commandBufferStaging->imageMemoryBarrier(dstImage, dstImage.m_imageLayout,
+	CommandBuffer& commandBufferStaging = stagingCommandBuffer();
+	commandBufferStaging.imageMemoryBarrier(dstImage, dstImage.m_imageLayout,
 	        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
 	        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
 
 	//before copyBufferToImage, host should make sure the right layout of image
-	commandBufferStaging->copyBufferToImage(*staging, dstImage, srcOffset, dstExtent, dstOffset);
+	commandBufferStaging.copyBufferToImage(staging, dstImage, offset + srcOffset, dstExtent, dstOffset);
 
 	//just workround : layout -> shader_read_only.  To be fixed
-	commandBufferStaging->imageMemoryBarrier(dstImage, dstImage.m_imageLayout,
+	commandBufferStaging.imageMemoryBarrier(dstImage, dstImage.m_imageLayout,
 	        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
 	        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
 
-	commandBufferStaging->end();
-
-	m_stagingCommandBuffers.push_back(std::move(commandBufferStaging));
-
 	// submit the command buffer immediately
 	if (submitOnce)
 		submitStaging(true, { }, { }, false);
-
-	m_usingBuffers.push_back(std::move(staging));
 }
 
 VkSemaphore GraphicContext::submitStaging(     bool waitFence/*=true*/,
@@ -1630,27 +1752,19 @@ VkSemaphore GraphicContext::submitStaging(     bool waitFence/*=true*/,
         const std::vector<VkPipelineStageFlags>& waitPipelineStageFlags /*={}*/,
         bool returnSignalSemaphore /*=true*/)
 {
-	if(m_stagingCommandBuffers.size() == 0)
+	if (!m_stagingOpen.commandBuffer)
 		return VK_NULL_HANDLE;
 
-	VkFence fence = VK_NULL_HANDLE;
-	if (waitFence)
-	{
-		VkFenceCreateInfo fenceInfo{};
-		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		fenceInfo.flags = 0;
+	m_stagingOpen.commandBuffer->end();
 
-		vkCreateFence(m_vulkanSetup.device, &fenceInfo, nullptr, &fence);
-	}
-	VkSemaphore signalSemaphore = submit(m_defaultQueue, m_stagingCommandBuffers, fence, waitSemaphores,
+	// always fenced, so that we know when the staging memory can be reused
+	VkFence fence = test_fence_acquire(m_vulkanSetup);
+	VkSemaphore signalSemaphore = submit(m_defaultQueue, { m_stagingOpen.commandBuffer }, fence, waitSemaphores,
 	                                     waitPipelineStageFlags, returnSignalSemaphore, false);
-	if (fence != VK_NULL_HANDLE)
-	{
-		VkResult result = vkWaitForFences(m_vulkanSetup.device, 1, &fence, VK_TRUE, UINT64_MAX);
-		check(result);
-		vkDestroyFence(m_vulkanSetup.device, fence, nullptr);
-		m_stagingCommandBuffers.clear();
-	}
+	m_stagingOpen.fence = fence;
+	m_stagingInFlight.push_back(std::move(m_stagingOpen));
+	m_stagingOpen = StagingBatch();
+	stagingRetire(waitFence);
 
 	return signalSemaphore;
 }
@@ -1661,9 +1775,12 @@ VkSemaphore GraphicContext::submit (VkQueue queue, const std::vector<std::shared
                                     const std::vector<VkPipelineStageFlags>& waitPipelineStageFlags /*={}*/,
                                     bool returnSignalSemaphore /*=true*/, bool returnFrameImage /*=false*/)
 {
+	semaphoreRetire(false);
+
 	std::vector<VkCommandBuffer> commands;
 	for (auto& iter : commandBuffers)
 		commands.push_back(iter->getHandle());
+	if (fence != VK_NULL_HANDLE) test_gpu_timer_wrap(m_vulkanSetup, queue, commands); // only time work we know is waited for
 
 	VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr};
 
@@ -1686,16 +1803,43 @@ VkSemaphore GraphicContext::submit (VkQueue queue, const std::vector<std::shared
 		submitInfo.pNext = &fbinfo;
 	}
 
+	// semaphores we returned earlier can be recycled once this submit has completed
+	std::vector<VkSemaphore> waited;
+	for (VkSemaphore semaphore : waitSemaphores)
+	{
+		auto it = std::find(m_returnSignalSemaphores.begin(), m_returnSignalSemaphores.end(), semaphore);
+		if (it == m_returnSignalSemaphores.end()) continue;
+		m_returnSignalSemaphores.erase(it);
+		waited.push_back(semaphore);
+	}
+
+	std::vector<VkSemaphore> signalSemaphores;
 	VkSemaphore signalSemaphore = VK_NULL_HANDLE;
 	if (returnSignalSemaphore)
 	{
-		VkSemaphoreCreateInfo semaphoreInfo{};
-		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-		vkCreateSemaphore(m_vulkanSetup.device, &semaphoreInfo, nullptr, &signalSemaphore);
+		signalSemaphore = test_semaphore_acquire(m_vulkanSetup);
 		m_returnSignalSemaphores.push_back(signalSemaphore);
+		signalSemaphores.push_back(signalSemaphore);
+	}
+	// the caller may not wait on its fence, or have none, so tell when the waits have completed by the queue
+	// timeline if we have one; otherwise the semaphores are only recycled in destroy()
+	uint64_t timelineValue = 0;
+	VkSemaphore timeline = waited.empty() ? VK_NULL_HANDLE : test_timeline_next(m_vulkanSetup, queue, timelineValue);
+	std::vector<uint64_t> signalValues(signalSemaphores.size(), 0); // ignored for binary semaphores
+	if (timeline != VK_NULL_HANDLE)
+	{
+		signalSemaphores.push_back(timeline);
+		signalValues.push_back(timelineValue);
+	}
+	submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+	submitInfo.pSignalSemaphores = signalSemaphores.data();
+	VkTimelineSemaphoreSubmitInfo timelineInfo = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO, submitInfo.pNext };
+	if (timeline != VK_NULL_HANDLE)
+	{
+		timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size());
+		timelineInfo.pSignalSemaphoreValues = signalValues.data();
+		submitInfo.pNext = &timelineInfo;
 	}
-	submitInfo.signalSemaphoreCount = (signalSemaphore == VK_NULL_HANDLE) ? 0 : 1;
-	submitInfo.pSignalSemaphores = (signalSemaphore == VK_NULL_HANDLE) ? nullptr: &signalSemaphore;
 
 	// TBD
 	if (returnFrameImage)
@@ -1706,9 +1850,24 @@ VkSemaphore GraphicContext::submit (VkQueue queue, const std::vector<std::shared
 	VkResult result = vkQueueSubmit(queue, 1, &submitInfo, fence);
 	check(result);
 
+	if (!waited.empty()) m_waitedSemaphores.push_back({ queue, timelineValue, std::move(waited) });
+
 	return signalSemaphore;
 }
 
+void GraphicContext::semaphoreRetire(bool wait)
+{
+	while (!m_waitedSemaphores.empty())
+	{
+		const WaitedSemaphores& front = m_waitedSemaphores.front();
+		if (front.timelineValue == 0 && !wait) break; // cannot tell, keep them until destroy() when the device is idle
+		if (front.timelineValue > 0 && wait) test_timeline_wait(m_vulkanSetup, front.queue, front.timelineValue);
+		else if (front.timelineValue > 0 && !test_timeline_reached(m_vulkanSetup, front.queue, front.timelineValue)) break;
+		for (VkSemaphore semaphore : front.semaphores) test_semaphore_release(m_vulkanSetup, semaphore);
+		m_waitedSemaphores.pop_front();
+	}
+}
+
 bool GraphicContext::saveImageOutput()
 {
 	if (!m_imageOutput)
@@ -1763,8 +1922,7 @@ bool GraphicContext::saveImageOutput()
 	if (!m_imageOutputBuffer || m_imageOutputBufferSize < size)
 	{
 		m_imageOutputBuffer = std::make_unique<Buffer>(m_vulkanSetup);
-		m_imageOutputBuffer->create(VK_BUFFER_USAGE_TRANSFER_DST_BIT, size,
-		                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		m_imageOutputBuffer->create(VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, TEST_MEMORY_READBACK);
 		m_imageOutputBufferSize = size;
 	}
 	if (!m_secondCommandBuffer)
@@ -1818,7 +1976,7 @@ bool GraphicContext::saveImageOutput()
 
 	std::string base = m_vulkanSetup.bench.test_name.empty() ? "graphics" : m_vulkanSetup.bench.test_name;
 	std::string filename = base + "_" + std::to_string(m_imageOutputFrame++) + ".png";
-	test_save_image(m_vulkanSetup, filename.c_str(), m_imageOutputBuffer->getMemory(), 0,
+	test_save_image(m_vulkanSetup, filename.c_str(), m_imageOutputBuffer->getMemory(), m_imageOutputBuffer->getMemoryOffset(),
 	                extent.width, extent.height, format);
 	bench_stop_scene(m_vulkanSetup.bench, filename.c_str());
 	return true;
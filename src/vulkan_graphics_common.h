@@ -3,6 +3,7 @@
 #include "vulkan_common.h"
 #include <memory>
 #include <functional>
+#include <deque>
 
 namespace tracetooltests
 {
@@ -18,7 +19,9 @@ public:
 	using AllocationCreateInfoFunc = std::function<void(VkMemoryAllocateInfo&)>;
 
 	Buffer(const vulkan_setup_t& vulkan): m_device(vulkan.device) {
-		emit_extra_flushes = vulkan.has_explicit_host_updates;
+		emit_extra_flushes = test_needs_flush(vulkan);
+		no_coherent = vulkan.no_coherent;
+		atom_size = vulkan.device_properties.limits.nonCoherentAtomSize;
 	}
 
 	~Buffer() {
@@ -26,8 +29,12 @@ public:
 	}
 
 	VkResult create(VkBufferUsageFlags usage, VkDeviceSize size, VkMemoryPropertyFlags properties, const std::vector<uint32_t>& queueFamilyIndices = { } );
+	/// As above, but pick the memory type with a strategy; getMemoryProperty() then returns the flags of the chosen type
+	VkResult create(VkBufferUsageFlags usage, VkDeviceSize size, test_memory_strategy strategy, const std::vector<uint32_t>& queueFamilyIndices = { } );
 	VkResult map(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE, VkMemoryMapFlags flag = 0);
-	void flush(bool extra); // flush mapped area (must be mapped!), 'extra' means flush is for information purposes and can be omitted
+	// flush mapped area (must be mapped!), 'extra' means flush is for information purposes and can be omitted, unless we use non-coherent memory
+	void flush(bool extra, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+	void invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE); // before reading device writes from the mapped area, only needed for non-coherent memory
 	void unmap();
 	VkDeviceAddress getBufferDeviceAddress();
 
@@ -39,6 +46,9 @@ public:
 	inline VkDeviceMemory getMemory() const {
 		return m_memory;
 	}
+	inline VkDeviceSize getMemoryOffset() const {
+		return m_suballocation.offset;
+	}
 	inline VkMemoryPropertyFlags getMemoryProperty() const {
 		return m_memoryProperty;
 	}
@@ -56,9 +66,14 @@ private:
 	VkResult create();
 
 	bool emit_extra_flushes = false;
+	bool no_coherent = false; // prefer non-coherent memory types, and make all flushes real ones
+	VkDeviceSize atom_size = 1;
+	VkDeviceSize m_mapOffset = 0; // start of our own mapping in m_memory, atom aligned; arena blocks are mapped whole
 	VkBuffer m_handle = VK_NULL_HANDLE;
 	VkDeviceMemory m_memory = VK_NULL_HANDLE;
+	test_suballocation m_suballocation; // used instead of a memory of our own if the test sub-allocates
 	VkMemoryPropertyFlags m_memoryProperty = VK_MEMORY_PROPERTY_FLAG_BITS_MAX_ENUM;
+	test_memory_strategy m_memoryStrategy = TEST_MEMORY_STRATEGIES; // none, pick by m_memoryProperty
 	VkDeviceAddress m_deviceAddress = 0;
 	VkDeviceSize m_size = 0;
 
@@ -867,7 +882,7 @@ public:
 	                   const std::vector<VkPipelineStageFlags>& waitPipelineStageFlags = {},
 	                   bool returnSignalSemaphore = true,  bool returnFrameImage = false);
 
-	// submit the stagingCommandBuffers and waitFence if needed,, and then clear it
+	// submit the uploads staged so far in one command buffer, and wait for them if waitFence
 	VkSemaphore submitStaging(bool waitFence = true,
 	                          const std::vector<VkSemaphore>&          waitSemaphores = {},
 	                          const std::vector<VkPipelineStageFlags>& waitPipelineStageFlags = {},
@@ -885,17 +900,50 @@ public:
 			vkDestroySemaphore(m_vulkanSetup.device, semaphore, nullptr);
 		}
 		m_returnSignalSemaphores.clear();
-		m_usingBuffers.clear();
-		if (m_stagingCommandBuffers.size() > 0)
-			m_stagingCommandBuffers.clear();
+		semaphoreRetire(true);
+		stagingDestroy();
 	}
 
-	std::vector<VkSemaphore> m_returnSignalSemaphores;
+	std::vector<VkSemaphore> m_returnSignalSemaphores; // returned by submit() and not yet waited on by another submit()
 	std::shared_ptr<RenderPass> m_renderPass;
 	std::shared_ptr<FrameBuffer> m_framebuffer; // vector future
-	std::vector<std::shared_ptr<CommandBuffer>> m_stagingCommandBuffers;
-	std::vector<std::unique_ptr<Buffer>> m_usingBuffers; // recyling
+	VkDeviceSize m_stagingRingSize = 8 * 1024 * 1024; // change before the first upload to resize the staging ring
 
+private:
+	/// Uploads recorded into one command buffer, and any staging buffers too big for the ring
+	struct StagingBatch
+	{
+		std::shared_ptr<CommandBuffer> commandBuffer;
+		VkFence fence = VK_NULL_HANDLE;
+		std::vector<std::unique_ptr<Buffer>> oversized;
+	};
+
+	/// Returned semaphores that a submit waited on, free once the queue timeline reaches the value, or zero if unknown
+	struct WaitedSemaphores
+	{
+		VkQueue queue = VK_NULL_HANDLE;
+		uint64_t timelineValue = 0;
+		std::vector<VkSemaphore> semaphores;
+	};
+
+	/// Copy data into staging memory, returning the buffer and setting the offset to copy from, aligned to a multiple of granularity
+	const Buffer& stagingWrite(const char* srcData, VkDeviceSize size, VkDeviceSize granularity, VkDeviceSize& offset);
+	/// The command buffer of the open batch, begun on first use
+	CommandBuffer& stagingCommandBuffer();
+	/// Recycle the submitted batches that have finished, or wait for all of them
+	void stagingRetire(bool wait);
+	void stagingDestroy();
+	/// Give returned semaphores back to the pool once the submits waiting on them have completed, or wait for them all.
+	/// Without timeline semaphores we cannot tell, so they are kept until called with wait, which assumes an idle device.
+	void semaphoreRetire(bool wait);
+
+	std::unique_ptr<Buffer> m_stagingRing; // persistently mapped
+	VkDeviceSize m_stagingHead = 0; // everything in flight lies before it, since we drain the ring on wrap around
+	VkDeviceSize m_stagingAlignment = 16;
+	StagingBatch m_stagingOpen;
+	std::deque<StagingBatch> m_stagingInFlight; // in submission order
+	std::vector<std::shared_ptr<CommandBuffer>> m_stagingFreeCommandBuffers;
+	std::deque<WaitedSemaphores> m_waitedSemaphores; // in submission order
 };
 
 
@@ -112,7 +112,7 @@ int main(int argc, char** argv)
 	{
 		src_data[i] = static_cast<unsigned char>((i * 13) & 0xff);
 	}
-	uint32_t expected_crc = adler32(src_data.data(), src_data.size());
+	uint32_t expected_crc = checksum(CHECKSUM_ADLER32, src_data.data(), src_data.size());
 
 	void* mapped = nullptr;
 	VkResult result = vkMapMemory(vulkan.device, src.memory, 0, buffer_size, 0, &mapped);
@@ -133,7 +133,7 @@ void build_simple_triangle_as(const vulkan_setup_t& vulkan, Context& context, Si
 	blas_addr_info.accelerationStructure = accel.blas.handle;
 	accel.blas.address.deviceAddress = context.functions.vkGetAccelerationStructureDeviceAddressKHR(vulkan.device, &blas_addr_info);
 
-	vkFreeMemory(vulkan.device, scratch.memory, nullptr);
+	testFreeMemory(vulkan, scratch.memory);
 	vkDestroyBuffer(vulkan.device, scratch.handle, nullptr);
 
 	static VkTransformMatrixKHR identity = {
@@ -221,7 +221,7 @@ void build_simple_triangle_as(const vulkan_setup_t& vulkan, Context& context, Si
 	check(vkQueueSubmit(context.queue, 1, &submit_info, VK_NULL_HANDLE));
 	check(vkQueueWaitIdle(context.queue));
 
-	vkFreeMemory(vulkan.device, tlas_scratch.memory, nullptr);
+	testFreeMemory(vulkan, tlas_scratch.memory);
 	vkDestroyBuffer(vulkan.device, tlas_scratch.handle, nullptr);
 }
 
@@ -230,19 +230,19 @@ void destroy_simple_triangle_as(const vulkan_setup_t& vulkan, Context& context,
 	context.functions.vkDestroyAccelerationStructureKHR(vulkan.device, accel.blas.handle, nullptr);
 	context.functions.vkDestroyAccelerationStructureKHR(vulkan.device, accel.tlas.handle, nullptr);
 
-	vkFreeMemory(vulkan.device, accel.blas_buffer.memory, nullptr);
+	testFreeMemory(vulkan, accel.blas_buffer.memory);
 	vkDestroyBuffer(vulkan.device, accel.blas_buffer.handle, nullptr);
 
-	vkFreeMemory(vulkan.device, accel.tlas_buffer.memory, nullptr);
+	testFreeMemory(vulkan, accel.tlas_buffer.memory);
 	vkDestroyBuffer(vulkan.device, accel.tlas_buffer.handle, nullptr);
 
-	vkFreeMemory(vulkan.device, accel.instance_buffer.memory, nullptr);
+	testFreeMemory(vulkan, accel.instance_buffer.memory);
 	vkDestroyBuffer(vulkan.device, accel.instance_buffer.handle, nullptr);
 
-	vkFreeMemory(vulkan.device, accel.index_buffer.memory, nullptr);
+	testFreeMemory(vulkan, accel.index_buffer.memory);
 	vkDestroyBuffer(vulkan.device, accel.index_buffer.handle, nullptr);
 
-	vkFreeMemory(vulkan.device, accel.vertex_buffer.memory, nullptr);
+	testFreeMemory(vulkan, accel.vertex_buffer.memory);
 	vkDestroyBuffer(vulkan.device, accel.vertex_buffer.handle, nullptr);
 }
 } // namespace ray_tracing_common
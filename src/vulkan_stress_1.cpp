@@ -5,13 +5,6 @@ static vulkan_req_t reqs;
 static int loops = 250000;
 static int variant = 1;
 
-static inline uint64_t mygettime()
-{
-	struct timespec t;
-	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
-	return ((uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec);
-}
-
 static void show_usage()
 {
 	printf("-c/--case N            Choose test case (default %d)\n", variant);
@@ -38,7 +31,7 @@ static bool test_cmdopt(int& i, int argc, char** argv, vulkan_req_t& reqs)
 static const char* case_1(vulkan_setup_t& vulkan, bool active)
 {
 	VkResult r;
-	bench_start_scene(vulkan.bench, "case 1 : vkEnumeratePhysicalDeviceGroups");
+	if (active) bench_start_scene(vulkan.bench, "case 1 : vkEnumeratePhysicalDeviceGroups");
 	if (active) bench_start_iteration(vulkan.bench);
 	for (int i = 0; i < loops; i++)
 	{
@@ -58,7 +51,7 @@ static const char* case_2(vulkan_setup_t& vulkan, bool active)
 	fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 	r = vkCreateFence(vulkan.device, &fence_create_info, NULL, &fence);
 	check(r);
-	bench_start_scene(vulkan.bench, "case 2 : vkGetFenceStatus");
+	if (active) bench_start_scene(vulkan.bench, "case 2 : vkGetFenceStatus");
 	if (active) bench_start_iteration(vulkan.bench);
 	for (int i = 0; i < loops; i++)
 	{
@@ -73,27 +66,32 @@ int main(int argc, char** argv)
 {
 	reqs.usage = show_usage;
 	reqs.cmdopt = test_cmdopt;
+	reqs.scenes = { { "case_1", "vkEnumeratePhysicalDeviceGroups", { "-c", "1" } }, { "case_2", "vkGetFenceStatus", { "-c", "2" } } };
 	vulkan_setup_t vulkan = test_init(argc, argv, "vulkan_stress_1", reqs);
 
-	// warmup
-	switch (variant)
+	test_run_scenes(vulkan, reqs, [&](const std::string& scene)
 	{
-	case 1: case_1(vulkan, false); break;
-	case 2: case_2(vulkan, false); break;
-	default: assert(false);
-	}
+		// warmup, outside of any benchmarking iteration so that every scene gets its own
+		switch (variant)
+		{
+		case 1: case_1(vulkan, false); break;
+		case 2: case_2(vulkan, false); break;
+		default: assert(false);
+		}
 
-	// measurement
-	const char* name = "no such test case";
-	uint64_t before = mygettime();
-	switch (variant)
-	{
-	case 1: name = case_1(vulkan, true); break;
-	case 2: name = case_2(vulkan, true); break;
-	default: assert(false);
-	}
-	uint64_t after = mygettime();
-	printf("Test case %d - %s, %d iterations: %lu\n", (int)variant, name, (int)loops, (unsigned long)(after - before));
+		// measurement
+		const char* name = "no such test case";
+		uint64_t before = bench_gettime();
+		switch (variant)
+		{
+		case 1: name = case_1(vulkan, true); break;
+		case 2: name = case_2(vulkan, true); break;
+		default: assert(false);
+		}
+		uint64_t after = bench_gettime();
+		const std::string label = scene.empty() ? "case_" + std::to_string(variant) : scene; // as in the scene registry
+		printf("Test %s - %s, %d iterations: %" PRIu64 " ns, %.2f ns per call\n", label.c_str(), name, (int)loops, after - before, (double)(after - before) / loops);
+	});
 
 	test_done(vulkan);
 
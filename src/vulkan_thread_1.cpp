@@ -15,6 +15,8 @@ static void thread_test_stress(int tid)
 	assert(used[tid] == 0);
 	used[tid] = 1;
 	assert(vulkan.device != VK_NULL_HANDLE);
+	bench_thread_init(vulkan.bench);
+	bench_start_iteration(vulkan.bench);
 
 	VkCommandPool cmdpool;
 	VkCommandPoolCreateInfo cmdcreateinfo = {};
@@ -42,6 +44,7 @@ static void thread_test_stress(int tid)
 
 	vkFreeCommandBuffers(vulkan.device, cmdpool, cmdbuffers.size(), cmdbuffers.data());
 	vkDestroyCommandPool(vulkan.device, cmdpool, nullptr);
+	bench_stop_iteration(vulkan.bench);
 
 	if (random() % 5 == 1) usleep(random() % 3 * 10000); // introduce some pseudo-random timings
 }
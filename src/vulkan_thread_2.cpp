@@ -38,6 +38,7 @@ static VkResult hack_vkAllocateCommandBuffers(VkDevice device, const VkCommandBu
 
 static void thread_test_stress(VkCommandPool *cmdpool, VkCommandBuffer* cmdbuffers)
 {
+	set_thread_name("stress thread");
 	VkCommandBufferAllocateInfo pAllocateInfo = {};
 	pAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	pAllocateInfo.commandBufferCount = BUFFERS;
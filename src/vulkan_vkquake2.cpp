@@ -387,7 +387,7 @@ public:
 	glm::mat4 mvpMatrix = glm::mat4(1.0f);
 };
 
-static void render(VkQuake2Context& ctx)
+static void render(VkQuake2Context& ctx, double time)
 {
 	VkCommandBuffer cmd = ctx.m_defaultCommandBuffer->getHandle();
 	VkExtent2D extent{ctx.width, ctx.height};
@@ -397,6 +397,11 @@ static void render(VkQuake2Context& ctx)
 	vkResetFences(vulkan.device, 1, &ctx.frameFence);
 	vkResetCommandBuffer(cmd, 0);
 
+	// Animate the water warp from simulated time, safe to update now that the previous frame is done
+	UboWarp* warp = (UboWarp*)ctx.ubo_water->m_mappedAddress;
+	warp->time = 0.5f + time;
+	ctx.ubo_water->flush(true, offsetof(UboWarp, time), sizeof(warp->time));
+
 	ctx.m_defaultCommandBuffer->begin();
 
 	// World pass transitions
@@ -1002,7 +1007,7 @@ int main(int argc, char** argv)
 		lmap.model = glm::mat4(1.0f);
 		lmap.viewLightmaps = 0.0f;
 		memcpy(ctx->ubo_world->m_mappedAddress, &lmap, sizeof(lmap));
-		ctx->ubo_world->flush(true);
+		ctx->ubo_world->flush(true, 0, sizeof(lmap));
 
 		UboWarp warp{};
 		warp.model = glm::mat4(1.0f);
@@ -1010,23 +1015,23 @@ int main(int argc, char** argv)
 		warp.time = 0.5f;
 		warp.scroll = 0.1f;
 		memcpy(ctx->ubo_water->m_mappedAddress, &warp, sizeof(warp));
-		ctx->ubo_water->flush(true);
+		ctx->ubo_water->flush(true, 0, sizeof(warp));
 
 		UboModel model{};
 		model.model = glm::mat4(1.0f);
 		model.textured = 1;
 		memcpy(ctx->ubo_model->m_mappedAddress, &model, sizeof(model));
-		ctx->ubo_model->flush(true);
+		ctx->ubo_model->flush(true, 0, sizeof(model));
 
 		UboSprite sprite{};
 		sprite.alpha = 0.8f;
 		memcpy(ctx->ubo_sprite->m_mappedAddress, &sprite, sizeof(sprite));
-		ctx->ubo_sprite->flush(true);
+		ctx->ubo_sprite->flush(true, 0, sizeof(sprite));
 
 		UboSky sky{};
 		sky.model = glm::scale(glm::mat4(1.0f), glm::vec3(3.0f));
 		memcpy(ctx->ubo_sky->m_mappedAddress, &sky, sizeof(sky));
-		ctx->ubo_sky->flush(true);
+		ctx->ubo_sky->flush(true, 0, sizeof(sky));
 
 		UboImageTransform ui{};
 		ui.offset = glm::vec2(0.6f, 0.6f);
@@ -1034,24 +1039,24 @@ int main(int argc, char** argv)
 		ui.uvOffset = glm::vec2(0.0f, 0.0f);
 		ui.uvScale = glm::vec2(1.0f, 1.0f);
 		memcpy(ctx->ubo_basic->m_mappedAddress, &ui, sizeof(ui));
-		ctx->ubo_basic->flush(true);
+		ctx->ubo_basic->flush(true, 0, sizeof(ui));
 
 		UboBeam beam{};
 		beam.color = glm::vec4(0.2f, 1.0f, 0.9f, 0.6f);
 		memcpy(ctx->ubo_beam->m_mappedAddress, &beam, sizeof(beam));
-		ctx->ubo_beam->flush(true);
+		ctx->ubo_beam->flush(true, 0, sizeof(beam));
 
 		UboDLight dlight{};
 		dlight.mvp = vp;
 		memcpy(ctx->ubo_dlight->m_mappedAddress, &dlight, sizeof(dlight));
-		ctx->ubo_dlight->flush(true);
+		ctx->ubo_dlight->flush(true, 0, sizeof(dlight));
 
 		UboColorQuad colorquad{};
 		colorquad.offset = glm::vec2(-0.6f, -0.6f);
 		colorquad.scale = glm::vec2(0.2f, 0.2f);
 		colorquad.color = glm::vec4(1.0f, 0.1f, 0.1f, 0.6f);
 		memcpy(ctx->ubo_colorquad->m_mappedAddress, &colorquad, sizeof(colorquad));
-		ctx->ubo_colorquad->flush(true);
+		ctx->ubo_colorquad->flush(true, 0, sizeof(colorquad));
 	}
 
 	// Pipeline layouts
@@ -1376,14 +1381,15 @@ int main(int argc, char** argv)
 
 	bool first_loop = true;
 	benchmarking bench = vulkan.bench;
-	while (p__loops--)
+	while (bench_loop(bench))
 	{
 		if (!first_loop)
 		{
 			bench_stop_iteration(bench);
 		}
 		bench_start_iteration(bench);
-		render(*ctx);
+		render(*ctx, bench_sim_time(bench));
+		bench_next_frame(bench);
 		first_loop = false;
 	}
 	bench_stop_iteration(bench);